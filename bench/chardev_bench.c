@@ -0,0 +1,346 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *dev_path = "/dev/chardev0";
+static size_t block_size = 4096;
+static int max_threads;
+static int duration = 2;
+static int iterations = 100000;
+static volatile int stop;
+static atomic_int acked;
+
+struct worker {
+	pthread_t thread;
+	int fd;
+	unsigned long long ops;
+	unsigned long long bytes;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *read_worker(void *arg)
+{
+	struct worker *w = arg;
+	off_t size = lseek(w->fd, 0, SEEK_END);
+	off_t pos = 0;
+	char *buf;
+
+	buf = malloc(block_size);
+	if (!buf) {
+		return NULL;
+	}
+
+	while (!stop) {
+		ssize_t n = pread(w->fd, buf, block_size, pos);
+
+		if (n < 0) {
+			perror("pread");
+			break;
+		}
+
+		w->ops++;
+		w->bytes += n;
+		pos += n;
+		if (!n || pos >= size) {
+			pos = 0;
+		}
+	}
+
+	free(buf);
+
+	return NULL;
+}
+
+static int run_readers(int nr)
+{
+	struct worker *workers;
+	unsigned long long ops = 0;
+	unsigned long long bytes = 0;
+	double start, elapsed;
+	int i;
+
+	workers = calloc(nr, sizeof(*workers));
+	if (!workers) {
+		return -1;
+	}
+
+	stop = 0;
+	for (i = 0; i < nr; i++) {
+		workers[i].fd = open(dev_path, O_RDONLY);
+		if (workers[i].fd < 0) {
+			fprintf(stderr, "%s: %s\n", dev_path, strerror(errno));
+			return -1;
+		}
+	}
+
+	start = now();
+	for (i = 0; i < nr; i++) {
+		pthread_create(&workers[i].thread, NULL, read_worker, &workers[i]);
+	}
+
+	sleep(duration);
+	stop = 1;
+
+	for (i = 0; i < nr; i++) {
+		pthread_join(workers[i].thread, NULL);
+		close(workers[i].fd);
+		ops += workers[i].ops;
+		bytes += workers[i].bytes;
+	}
+	elapsed = now() - start;
+
+	printf("%4d threads: %12.0f reads/s %10.1f MiB/s\n", nr,
+		ops / elapsed, bytes / elapsed / (1 << 20));
+
+	free(workers);
+
+	return 0;
+}
+
+static int bench_read_scaling(void)
+{
+	int nr;
+
+	printf("read scaling on %s, %zu byte reads, %d s per step\n",
+		dev_path, block_size, duration);
+
+	for (nr = 1; nr <= max_threads; nr *= 2) {
+		if (run_readers(nr) < 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int set_mode(const char *mode)
+{
+	char path[256];
+	char *dev;
+	FILE *f;
+	int rc;
+
+	dev = strdup(dev_path);
+	if (!dev) {
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "/sys/class/chardev/%s/mode", basename(dev));
+	free(dev);
+
+	f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	rc = fprintf(f, "%s\n", mode) < 0 ? -1 : 0;
+	if (fclose(f) != 0) {
+		rc = -1;
+	}
+
+	if (rc < 0) {
+		fprintf(stderr, "%s: cannot select mode %s\n", path, mode);
+	}
+
+	return rc;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct consumer {
+	pthread_t thread;
+	int fd;
+	uint64_t *samples;
+};
+
+static void *latency_consumer(void *arg)
+{
+	struct consumer *c = arg;
+	uint64_t sent;
+	int i;
+
+	for (i = 0; i < iterations; i++) {
+		size_t done = 0;
+
+		while (done < sizeof(sent)) {
+			ssize_t n = read(c->fd, (char *)&sent + done, sizeof(sent) - done);
+
+			if (n <= 0) {
+				perror("read");
+				return NULL;
+			}
+			done += n;
+		}
+
+		c->samples[i] = now_ns() - sent;
+		atomic_store_explicit(&acked, i + 1, memory_order_release);
+	}
+
+	return NULL;
+}
+
+static int run_latency(const char *mode)
+{
+	struct consumer c;
+	uint64_t sum = 0;
+	int wfd;
+	int i;
+
+	if (set_mode(mode) < 0) {
+		return -1;
+	}
+
+	c.samples = calloc(iterations, sizeof(*c.samples));
+	c.fd = open(dev_path, O_RDONLY);
+	wfd = open(dev_path, O_WRONLY);
+	if (!c.samples || c.fd < 0 || wfd < 0) {
+		fprintf(stderr, "%s: %s\n", dev_path, strerror(errno));
+		return -1;
+	}
+
+	atomic_store(&acked, 0);
+	pthread_create(&c.thread, NULL, latency_consumer, &c);
+
+	for (i = 0; i < iterations; i++) {
+		uint64_t sent = now_ns();
+
+		if (write(wfd, &sent, sizeof(sent)) != sizeof(sent)) {
+			perror("write");
+			break;
+		}
+
+		while (atomic_load_explicit(&acked, memory_order_acquire) <= i) {
+		}
+	}
+
+	pthread_join(c.thread, NULL);
+	close(wfd);
+	close(c.fd);
+
+	qsort(c.samples, iterations, sizeof(*c.samples), cmp_u64);
+	for (i = 0; i < iterations; i++) {
+		sum += c.samples[i];
+	}
+
+	printf("%-8s avg %8.0f ns  p50 %8llu ns  p99 %8llu ns  max %8llu ns\n",
+		mode, (double)sum / iterations,
+		(unsigned long long)c.samples[iterations / 2],
+		(unsigned long long)c.samples[iterations * 99 / 100],
+		(unsigned long long)c.samples[iterations - 1]);
+
+	free(c.samples);
+
+	return 0;
+}
+
+static int bench_latency(char **modes, int nr)
+{
+	int i;
+
+	if (!nr) {
+		static char *defaults[] = { "fifo", "spsc" };
+
+		modes = defaults;
+		nr = 2;
+	}
+
+	printf("message latency on %s, %d messages\n", dev_path, iterations);
+
+	for (i = 0; i < nr; i++) {
+		if (run_latency(modes[i]) < 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d device] [-b block size] [-t max threads] "
+		"[-s seconds] read-scaling\n"
+		"       %s [-d device] [-n messages] latency [mode...]\n",
+		prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+
+	max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((opt = getopt(argc, argv, "d:b:t:s:n:")) != -1) {
+		switch (opt) {
+			case 'd':
+				dev_path = optarg;
+				break;
+			case 'b':
+				block_size = strtoul(optarg, NULL, 0);
+				break;
+			case 't':
+				max_threads = atoi(optarg);
+				break;
+			case 's':
+				duration = atoi(optarg);
+				break;
+			case 'n':
+				iterations = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind >= argc || !block_size || max_threads < 1 || duration < 1 ||
+		iterations < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!strcmp(argv[optind], "read-scaling")) {
+		return bench_read_scaling();
+	}
+
+	if (!strcmp(argv[optind], "latency")) {
+		return bench_latency(argv + optind + 1, argc - optind - 1);
+	}
+
+	usage(argv[0]);
+
+	return 1;
+}
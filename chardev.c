@@ -1,150 +1,4342 @@
+#include <linux/bsearch.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
+#include <linux/hash.h>
 #include <linux/init.h>
+#include <linux/jiffies.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/mm.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/poll.h>
+#include <linux/rcupdate.h>
+#include <linux/refcount.h>
+#include <linux/rwsem.h>
+#include <linux/sched/signal.h>
+#include <linux/shrinker.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/splice.h>
+#include <linux/timekeeping.h>
+#include <linux/uio.h>
 #include <linux/uaccess.h>
+#include <linux/wait.h>
+#include <linux/xarray.h>
+
+#include "chardev.h"
 
 #define DRV_NAME "chardev"
 #define DRV_CLASS_NAME "chardev"
 
-#define NUM_OF_DEVS 4
+#define NUM_OF_DEVS 4
+#define CHARDEV_MAX_DEVS 256
+
+#define CHARDEV_DEF_BUFSIZE PAGE_SIZE
+/* On 32-bit the size and page rounding of the buffer must fit in size_t. */
+#define CHARDEV_MAX_BUFSIZE min_t(u64, 16ULL << 40, SIZE_MAX & PAGE_MASK)
+#define CHARDEV_TXN_MAX_BYTES (16 << 20)
+#define CHARDEV_WAIT_BITS 8
+
+MODULE_AUTHOR("Michal Miladowski <michal.miladowski@gmail.com>");
+MODULE_DESCRIPTION("Character Device Driver Template");
+MODULE_LICENSE("GPL");
+
+static unsigned int num_devs = NUM_OF_DEVS;
+module_param(num_devs, uint, 0444);
+MODULE_PARM_DESC(num_devs, "Number of devices created at load time");
+
+static unsigned long buffer_size = CHARDEV_DEF_BUFSIZE;
+module_param(buffer_size, ulong, 0444);
+MODULE_PARM_DESC(buffer_size, "Initial size of each device buffer in bytes");
+
+static char *default_mode = "buffer";
+module_param_named(mode, default_mode, charp, 0444);
+MODULE_PARM_DESC(mode, "Initial mode of each device (buffer, fifo, spsc, shmring, record, broadcast, flight, sharded, snapshot)");
+
+enum {
+	CHARDEV_SPSC_READER,
+	CHARDEV_SPSC_WRITER,
+	CHARDEV_REPLICAS_STALE,
+};
+
+struct chardev_data;
+struct chardev_version;
+
+struct chardev_mode {
+	const char *name;
+	const struct file_operations *fops;
+	int (*open)(struct inode *inode, struct file *filp);
+	int (*reset)(struct chardev_data *dev);
+	void (*leave)(struct chardev_data *dev);
+};
+
+struct chardev_shard {
+	struct mutex lock;
+	unsigned int cpu;
+	size_t base;
+	size_t head;
+	size_t tail;
+	size_t used;
+};
+
+struct chardev_data {
+	struct device device;
+	struct cdev cdev;
+	struct xarray pages;
+	size_t size;
+	struct rw_semaphore rwsem;
+	struct mutex map_lock;
+	atomic_t mmap_count;
+	atomic_t open_count;
+	spinlock_t gen_lock;
+	atomic64_t write_gen;
+	atomic64_t all_gen;
+	atomic_long_t nr_pages;
+	int node;
+	struct xarray *replicas;
+	atomic_long_t nr_replica_pages;
+	bool reclaim;
+	unsigned long reclaim_pos;
+	u64 reclaim_gen;
+	u64 reclaim_pass_gen;
+	const struct chardev_mode *mode;
+	unsigned long flags;
+	wait_queue_head_t read_wq;
+	wait_queue_head_t write_wq;
+	size_t head ____cacheline_aligned_in_smp;
+	size_t tail ____cacheline_aligned_in_smp;
+	u64 seq;
+	struct chardev_shard __percpu *shards;
+	size_t shard_size;
+	struct chardev_version __rcu *version;
+};
+
+struct chardev_file {
+	struct chardev_data *dev;
+	struct mutex lock;
+	u64 seq;
+	size_t pos;
+	u64 snapshot;
+};
+
+static dev_t chardev_id;
+static struct class *chardev_class;
+static DEFINE_XARRAY(chardev_devs);
+static DEFINE_MUTEX(chardev_devs_lock);
+static struct shrinker *chardev_shrinker;
+static wait_queue_head_t chardev_wait_table[1 << CHARDEV_WAIT_BITS];
+static atomic_t chardev_waiters = ATOMIC_INIT(0);
+
+static void chardev_free_pages(struct page **pages, unsigned long first,
+	unsigned long last)
+{
+	unsigned long i;
+
+	for (i = first; i < last; i++) {
+		if (pages[i]) {
+			put_page(pages[i]);
+		}
+	}
+}
+
+/* Every other mode carries ring state over the buffer and needs a reset. */
+static bool chardev_is_buffer_mode(struct chardev_data *dev)
+{
+	return !dev->mode->reset;
+}
+
+static struct page *chardev_page(struct chardev_data *dev, unsigned long idx)
+{
+	return xa_load(&dev->pages, idx);
+}
+
+static void chardev_truncate(struct chardev_data *dev, unsigned long first)
+{
+	struct page *page;
+	unsigned long idx;
+
+	xa_for_each_start(&dev->pages, idx, page, first) {
+		xa_erase(&dev->pages, idx);
+		put_page(page);
+		atomic_long_dec(&dev->nr_pages);
+	}
+}
+
+/*
+ * Pages are placed on the device's NUMA node, or on the node of the task
+ * that first touches them if none is set.
+ */
+static struct page *chardev_alloc_page(struct chardev_data *dev, gfp_t gfp)
+{
+	return alloc_pages_node(READ_ONCE(dev->node), gfp, 0);
+}
+
+/*
+ * With replicas enabled, buffer-mode reads are served from a read-only copy
+ * of each page on the reader's node, made on first access. Every change to
+ * a page drops its copies, so they are only ever dropped under the
+ * exclusive lock: atomic operations then take it as well, and faults on a
+ * mapping bypass the copies. Unmapping cannot take the lock, so it flags
+ * the copies as stale instead and reads bypass them until the next change
+ * or the shrinker drops them all.
+ */
+static void chardev_replicas_drop(struct chardev_data *dev,
+	unsigned long first, unsigned long last)
+{
+	struct page *page;
+	unsigned long idx;
+	int nid;
+
+	if (!dev->replicas) {
+		return;
+	}
+
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		xa_for_each_range(&dev->replicas[nid], idx, page, first, last) {
+			xa_erase(&dev->replicas[nid], idx);
+			put_page(page);
+			atomic_long_dec(&dev->nr_replica_pages);
+		}
+	}
+}
+
+static int chardev_replicas_enable(struct chardev_data *dev)
+{
+	int nid;
+
+	if (dev->replicas) {
+		return 0;
+	}
+
+	dev->replicas = kcalloc(nr_node_ids, sizeof(*dev->replicas),
+		GFP_KERNEL_ACCOUNT);
+	if (!dev->replicas) {
+		return -ENOMEM;
+	}
+
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		xa_init_flags(&dev->replicas[nid], XA_FLAGS_ACCOUNT);
+	}
+
+	return 0;
+}
+
+static void chardev_replicas_disable(struct chardev_data *dev)
+{
+	chardev_replicas_drop(dev, 0, ULONG_MAX);
+	kfree(dev->replicas);
+	dev->replicas = NULL;
+}
+
+static struct page *chardev_read_page(struct chardev_data *dev,
+	unsigned long idx)
+{
+	struct page *page = chardev_page(dev, idx);
+	struct page *copy;
+	struct xarray *xa;
+	int nid;
+
+	if (!page || !chardev_is_buffer_mode(dev) || !dev->replicas ||
+		atomic_read(&dev->mmap_count)) {
+		return page;
+	}
+
+	/* Pairs with the barrier in chardev_vma_close(). */
+	smp_rmb();
+	if (test_bit(CHARDEV_REPLICAS_STALE, &dev->flags)) {
+		return page;
+	}
+
+	nid = numa_node_id();
+	if (page_to_nid(page) == nid) {
+		return page;
+	}
+
+	xa = &dev->replicas[nid];
+	copy = xa_load(xa, idx);
+	if (copy) {
+		return copy;
+	}
+
+	copy = alloc_pages_node(nid, GFP_KERNEL_ACCOUNT | __GFP_THISNODE |
+		__GFP_NOWARN, 0);
+	if (!copy) {
+		return page;
+	}
+
+	copy_page(page_address(copy), page_address(page));
+
+	page = xa_cmpxchg(xa, idx, NULL, copy, GFP_KERNEL);
+	if (page) {
+		put_page(copy);
+		return xa_is_err(page) ? chardev_page(dev, idx) : page;
+	}
+
+	atomic_long_inc(&dev->nr_replica_pages);
+
+	return copy;
+}
+
+/* Unmapping raises this without the lock, so it only ever moves forward. */
+static void chardev_raise_all_gen(struct chardev_data *dev, u64 gen)
+{
+	s64 old = atomic64_read(&dev->all_gen);
+
+	do {
+		if (old >= gen) {
+			return;
+		}
+	} while (!atomic64_try_cmpxchg(&dev->all_gen, &old, gen));
+}
+
+static void chardev_bump_all_gen(struct chardev_data *dev)
+{
+	spin_lock(&dev->gen_lock);
+	chardev_raise_all_gen(dev, atomic64_inc_return(&dev->write_gen));
+	spin_unlock(&dev->gen_lock);
+}
+
+/*
+ * The buffer is a sparse xarray of individually allocated pages indexed by
+ * page offset, so a device can span terabytes while memory use follows the
+ * bytes actually written. Pages are only allocated when first written, a
+ * missing page reads as zeroes. Contents up to the smaller of the old and
+ * new size are preserved.
+ */
+static int chardev_resize(struct chardev_data *dev, size_t size)
+{
+	unsigned long nr = DIV_ROUND_UP(size, PAGE_SIZE);
+	struct page *page;
+
+	if (size < dev->size) {
+		chardev_truncate(dev, nr);
+
+		page = chardev_page(dev, nr - 1);
+		if (page && offset_in_page(size)) {
+			memset(page_address(page) + offset_in_page(size), 0,
+				PAGE_SIZE - offset_in_page(size));
+		}
+	}
+
+	/* Report everything as changed rather than track what resizing did. */
+	chardev_replicas_drop(dev, 0, ULONG_MAX);
+	chardev_bump_all_gen(dev);
+	WRITE_ONCE(dev->size, size);
+
+	return 0;
+}
+
+/*
+ * Writers hold the exclusive lock, but atomic operations and faults on a
+ * mapping populate pages under the shared lock or none at all, so a page
+ * is only installed if the slot is still empty. Pages are charged to the
+ * memory cgroup of the task that first touches them.
+ */
+static int chardev_populate(struct chardev_data *dev, u64 pos, u64 len)
+{
+	struct page *page;
+	struct page *old;
+	unsigned long i;
+
+	if (!len) {
+		return 0;
+	}
+
+	for (i = pos >> PAGE_SHIFT; i <= (pos + len - 1) >> PAGE_SHIFT; i++) {
+		if (chardev_page(dev, i)) {
+			continue;
+		}
+
+		page = chardev_alloc_page(dev, GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+		if (!page) {
+			return -ENOMEM;
+		}
+
+		old = xa_cmpxchg(&dev->pages, i, NULL, page, GFP_KERNEL);
+		if (old) {
+			put_page(page);
+			if (xa_is_err(old)) {
+				return xa_err(old);
+			}
+			continue;
+		}
+
+		atomic_long_inc(&dev->nr_pages);
+	}
+
+	return 0;
+}
+
+/* Modes other than buffer use the whole buffer, so it is populated first. */
+static int chardev_reset(struct chardev_data *dev,
+	const struct chardev_mode *mode)
+{
+	int rc;
+
+	rc = chardev_populate(dev, 0, dev->size);
+	if (rc < 0) {
+		return rc;
+	}
+
+	return mode->reset(dev);
+}
+
+static void chardev_free_buffer(struct chardev_data *dev)
+{
+	if (dev->mode && dev->mode->leave) {
+		dev->mode->leave(dev);
+	}
+	dev->mode = NULL;
+
+	chardev_replicas_disable(dev);
+	chardev_truncate(dev, 0);
+	xa_destroy(&dev->pages);
+	dev->size = 0;
+}
+
+/*
+ * Every modification of the page array or its contents bumps write_gen and
+ * stamps the pages it touched with the new value in page->private, which
+ * lets transactions detect concurrent writers and clients ask for the
+ * ranges changed since a generation they have seen. Holes never change
+ * other than through chardev_mark_all(). Atomic operations stamp under the
+ * shared lock, so a generation and its stamps are published together under
+ * gen_lock.
+ */
+static void chardev_mark_dirty(struct chardev_data *dev, u64 pos, u64 len)
+{
+	struct page *page;
+	unsigned long i;
+	u64 gen;
+
+	if (!len) {
+		atomic64_inc(&dev->write_gen);
+		return;
+	}
+
+	spin_lock(&dev->gen_lock);
+	gen = atomic64_inc_return(&dev->write_gen);
+	for (i = pos >> PAGE_SHIFT; i <= (pos + len - 1) >> PAGE_SHIFT; i++) {
+		page = chardev_page(dev, i);
+		if (page) {
+			set_page_private(page, gen);
+		}
+	}
+	spin_unlock(&dev->gen_lock);
+
+	if (test_and_clear_bit(CHARDEV_REPLICAS_STALE, &dev->flags)) {
+		chardev_replicas_drop(dev, 0, ULONG_MAX);
+	} else {
+		chardev_replicas_drop(dev, pos >> PAGE_SHIFT,
+			(pos + len - 1) >> PAGE_SHIFT);
+	}
+}
+
+static void chardev_mark_all(struct chardev_data *dev)
+{
+	chardev_bump_all_gen(dev);
+	chardev_replicas_drop(dev, 0, ULONG_MAX);
+	clear_bit(CHARDEV_REPLICAS_STALE, &dev->flags);
+}
+
+static size_t chardev_copy_from_iter(struct chardev_data *dev, loff_t pos,
+	struct iov_iter *from, size_t count)
+{
+	size_t done = 0;
+
+	while (done < count) {
+		size_t off = offset_in_page(pos);
+		size_t len = min_t(size_t, count - done, PAGE_SIZE - off);
+		size_t n;
+
+		n = copy_page_from_iter(chardev_page(dev, pos >> PAGE_SHIFT), off,
+			len, from);
+		done += n;
+		pos += n;
+		if (n < len) {
+			break;
+		}
+	}
+
+	return done;
+}
+
+static size_t chardev_copy_to_iter(struct chardev_data *dev, loff_t pos,
+	struct iov_iter *to, size_t count)
+{
+	size_t done = 0;
+
+	while (done < count) {
+		size_t off = offset_in_page(pos);
+		size_t len = min_t(size_t, count - done, PAGE_SIZE - off);
+		struct page *page = chardev_read_page(dev, pos >> PAGE_SHIFT);
+		size_t n;
+
+		if (page) {
+			n = copy_page_to_iter(page, off, len, to);
+		} else {
+			n = iov_iter_zero(len, to);
+		}
+		done += n;
+		pos += n;
+		if (n < len) {
+			break;
+		}
+	}
+
+	return done;
+}
+
+static int chardev_down_read(struct chardev_data *dev, struct kiocb *iocb)
+{
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		return down_read_trylock(&dev->rwsem) ? 0 : -EAGAIN;
+	}
+
+	down_read(&dev->rwsem);
+
+	return 0;
+}
+
+static int chardev_down_write(struct chardev_data *dev, struct kiocb *iocb)
+{
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		return down_write_trylock(&dev->rwsem) ? 0 : -EAGAIN;
+	}
+
+	down_write(&dev->rwsem);
+
+	return 0;
+}
+
+static bool chardev_nonblock(struct kiocb *iocb)
+{
+	return (iocb->ki_filp->f_flags & O_NONBLOCK) ||
+		(iocb->ki_flags & IOCB_NOWAIT);
+}
+
+/*
+ * Ring modes keep head and tail as offsets into the buffer and leave one
+ * byte unused, so that head == tail always means empty.
+ */
+static size_t chardev_ring_count(struct chardev_data *dev, size_t head,
+	size_t tail)
+{
+	return head >= tail ? head - tail : dev->size - tail + head;
+}
+
+static size_t chardev_ring_used(struct chardev_data *dev)
+{
+	return chardev_ring_count(dev, READ_ONCE(dev->head), READ_ONCE(dev->tail));
+}
+
+static size_t chardev_ring_free(struct chardev_data *dev)
+{
+	return dev->size - 1 - chardev_ring_used(dev);
+}
+
+static size_t chardev_ring_from_iter(struct chardev_data *dev, size_t pos,
+	struct iov_iter *from, size_t count)
+{
+	size_t first = min(count, dev->size - pos);
+	size_t done;
+
+	done = chardev_copy_from_iter(dev, pos, from, first);
+	if (done == first && count > first) {
+		done += chardev_copy_from_iter(dev, 0, from, count - first);
+	}
+
+	return done;
+}
+
+static size_t chardev_ring_to_iter(struct chardev_data *dev, size_t pos,
+	struct iov_iter *to, size_t count)
+{
+	size_t first = min(count, dev->size - pos);
+	size_t done;
+
+	done = chardev_copy_to_iter(dev, pos, to, first);
+	if (done == first && count > first) {
+		done += chardev_copy_to_iter(dev, 0, to, count - first);
+	}
+
+	return done;
+}
+
+static size_t chardev_ring_advance(struct chardev_data *dev, size_t pos,
+	size_t count)
+{
+	pos += count;
+	if (pos >= dev->size) {
+		pos -= dev->size;
+	}
+
+	return pos;
+}
+
+static void chardev_ring_put(struct chardev_data *dev, size_t pos,
+	const void *src, size_t len)
+{
+	while (len) {
+		size_t off = offset_in_page(pos);
+		size_t n = min3(len, PAGE_SIZE - off, dev->size - pos);
+
+		memcpy(page_address(chardev_page(dev, pos >> PAGE_SHIFT)) + off, src,
+			n);
+		src += n;
+		len -= n;
+		pos = chardev_ring_advance(dev, pos, n);
+	}
+}
+
+static void chardev_ring_get(struct chardev_data *dev, size_t pos, void *dst,
+	size_t len)
+{
+	while (len) {
+		size_t off = offset_in_page(pos);
+		size_t n = min3(len, PAGE_SIZE - off, dev->size - pos);
+
+		memcpy(dst, page_address(chardev_page(dev, pos >> PAGE_SHIFT)) + off,
+			n);
+		dst += n;
+		len -= n;
+		pos = chardev_ring_advance(dev, pos, n);
+	}
+}
+
+/*
+ * Waiters on buffer words sleep on a queue hashed from the device and the
+ * 8 byte slot holding the word, and their wake function filters on the
+ * exact range, so a write only wakes the waiters whose word it touched.
+ */
+struct chardev_waiter {
+	struct wait_queue_entry wq_entry;
+	struct chardev_data *dev;
+	u64 offset;
+	u32 size;
+};
+
+struct chardev_wait_key {
+	struct chardev_data *dev;
+	u64 start;
+	u64 end;
+};
+
+static wait_queue_head_t *chardev_wait_queue(struct chardev_data *dev,
+	u64 slot)
+{
+	return &chardev_wait_table[hash_long((unsigned long)dev + slot,
+		CHARDEV_WAIT_BITS)];
+}
+
+static int chardev_wake_function(struct wait_queue_entry *wq_entry,
+	unsigned int mode, int sync, void *arg)
+{
+	struct chardev_waiter *w = container_of(wq_entry, struct chardev_waiter,
+		wq_entry);
+	struct chardev_wait_key *key = arg;
+
+	if (w->dev != key->dev || w->offset >= key->end ||
+		w->offset + w->size <= key->start) {
+		return 0;
+	}
+
+	return autoremove_wake_function(wq_entry, mode, sync, NULL);
+}
+
+/*
+ * Called after the data was stored, pairs with the barrier in chardev_wait.
+ * Writes on every device come through here, so the wait table is only
+ * looked at while some task anywhere is in chardev_wait.
+ */
+static void chardev_wake_range(struct chardev_data *dev, u64 pos, u64 len)
+{
+	struct chardev_wait_key key = {
+		.dev = dev,
+		.start = pos,
+		.end = pos + len,
+	};
+	u64 first = pos >> 3;
+	u64 last = (pos + len - 1) >> 3;
+	wait_queue_head_t *wq;
+	u64 i;
+
+	if (!len) {
+		return;
+	}
+
+	smp_mb();
+
+	if (!atomic_read(&chardev_waiters)) {
+		return;
+	}
+
+	if (last - first >= ARRAY_SIZE(chardev_wait_table)) {
+		for (i = 0; i < ARRAY_SIZE(chardev_wait_table); i++) {
+			wq = &chardev_wait_table[i];
+			if (waitqueue_active(wq)) {
+				__wake_up(wq, TASK_INTERRUPTIBLE, 0, &key);
+			}
+		}
+		return;
+	}
+
+	for (i = first; i <= last; i++) {
+		wq = chardev_wait_queue(dev, i);
+		if (waitqueue_active(wq)) {
+			__wake_up(wq, TASK_INTERRUPTIBLE, 0, &key);
+		}
+	}
+}
+
+static ssize_t chardev_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct chardev_data *dev = iocb->ki_filp->private_data;
+	size_t count = iov_iter_count(from);
+	loff_t pos = iocb->ki_pos;
+	size_t copied;
+	int rc;
+
+	rc = chardev_down_write(dev, iocb);
+	if (rc < 0) {
+		return rc;
+	}
+
+	if (pos >= dev->size) {
+		up_write(&dev->rwsem);
+		return -EFBIG;
+	}
+
+	if (count > dev->size - pos) {
+		count = dev->size - pos;
+	}
+
+	rc = chardev_populate(dev, pos, count);
+	if (rc < 0) {
+		up_write(&dev->rwsem);
+		return rc;
+	}
+
+	copied = chardev_copy_from_iter(dev, pos, from, count);
+	if (!copied && count) {
+		up_write(&dev->rwsem);
+		return -EFAULT;
+	}
+
+	iocb->ki_pos += copied;
+	chardev_mark_dirty(dev, pos, copied);
+
+	up_write(&dev->rwsem);
+
+	chardev_wake_range(dev, pos, copied);
+
+	return copied;
+}
+
+static ssize_t chardev_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct chardev_data *dev = iocb->ki_filp->private_data;
+	size_t count = iov_iter_count(to);
+	loff_t pos = iocb->ki_pos;
+	size_t copied;
+	int rc;
+
+	rc = chardev_down_read(dev, iocb);
+	if (rc < 0) {
+		return rc;
+	}
+
+	if (pos >= dev->size) {
+		up_read(&dev->rwsem);
+		return 0;
+	}
+
+	if (count > dev->size - pos) {
+		count = dev->size - pos;
+	}
+
+	copied = chardev_copy_to_iter(dev, pos, to, count);
+	if (!copied && count) {
+		up_read(&dev->rwsem);
+		return -EFAULT;
+	}
+
+	iocb->ki_pos += copied;
+
+	up_read(&dev->rwsem);
+
+	return copied;
+}
+
+/*
+ * Hand references to the buffer pages to the pipe instead of copying them,
+ * so that splice()/sendfile() to a socket never touches the data. As with
+ * the page cache, a later write to the device is visible to data that is
+ * still sitting in the pipe. The buffers can outlive the module, so they
+ * use the core's operations rather than our own.
+ */
+static ssize_t chardev_splice_read(struct file *filp, loff_t *ppos,
+	struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	struct chardev_data *dev = filp->private_data;
+	loff_t pos = *ppos;
+	size_t spliced = 0;
+
+	down_read(&dev->rwsem);
+
+	if (pos >= dev->size) {
+		up_read(&dev->rwsem);
+		return 0;
+	}
+
+	if (len > dev->size - pos) {
+		len = dev->size - pos;
+	}
+
+	while (spliced < len &&
+		!pipe_full(pipe->head, pipe->tail, pipe->max_usage)) {
+		struct pipe_buffer *buf = pipe_head_buf(pipe);
+		struct page *page = chardev_page(dev, pos >> PAGE_SHIFT);
+		size_t off = offset_in_page(pos);
+		size_t part = min_t(size_t, len - spliced, PAGE_SIZE - off);
+
+		if (!page) {
+			page = ZERO_PAGE(0);
+		}
+
+		get_page(page);
+		*buf = (struct pipe_buffer) {
+			.ops = &nosteal_pipe_buf_ops,
+			.page = page,
+			.offset = off,
+			.len = part,
+		};
+		pipe->head++;
+
+		pos += part;
+		spliced += part;
+	}
+
+	up_read(&dev->rwsem);
+
+	*ppos = pos;
+
+	return spliced;
+}
+
+static s64 chardev_batch_one(struct chardev_data *dev,
+	struct chardev_batch_entry *ent)
+{
+	void __user *buf = u64_to_user_ptr(ent->addr);
+	struct iov_iter iter;
+	size_t len = ent->len;
+	size_t done;
+	int rc;
+
+	if (ent->offset >= dev->size) {
+		return ent->op == CHARDEV_BATCH_WRITE ? -EFBIG : 0;
+	}
+
+	if (len > dev->size - ent->offset) {
+		len = dev->size - ent->offset;
+	}
+
+	if (ent->op == CHARDEV_BATCH_WRITE) {
+		rc = import_ubuf(ITER_SOURCE, buf, len, &iter);
+		if (rc < 0) {
+			return rc;
+		}
+		rc = chardev_populate(dev, ent->offset, len);
+		if (rc < 0) {
+			return rc;
+		}
+		done = chardev_copy_from_iter(dev, ent->offset, &iter, len);
+	} else {
+		rc = import_ubuf(ITER_DEST, buf, len, &iter);
+		if (rc < 0) {
+			return rc;
+		}
+		done = chardev_copy_to_iter(dev, ent->offset, &iter, len);
+	}
+
+	return done || !len ? done : -EFAULT;
+}
+
+static long chardev_batch(struct chardev_data *dev,
+	struct chardev_batch __user *ubatch)
+{
+	struct chardev_batch_entry *entries;
+	struct chardev_batch batch;
+	bool write = false;
+	u64 total = 0;
+	size_t size;
+	long rc = 0;
+	u32 i;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)) != 0) {
+		return -EFAULT;
+	}
+
+	if (!batch.count || batch.count > CHARDEV_BATCH_MAX || batch.flags) {
+		return -EINVAL;
+	}
+
+	size = batch.count * sizeof(*entries);
+	entries = memdup_user(u64_to_user_ptr(batch.entries), size);
+	if (IS_ERR(entries)) {
+		return PTR_ERR(entries);
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		if (entries[i].op > CHARDEV_BATCH_WRITE) {
+			rc = -EINVAL;
+			goto out;
+		}
+		write |= entries[i].op == CHARDEV_BATCH_WRITE;
+
+		/* The whole batch runs under one lock hold, bound it like a write. */
+		total += entries[i].len;
+		if (total > MAX_RW_COUNT) {
+			rc = -E2BIG;
+			goto out;
+		}
+	}
+
+	if (write) {
+		down_write(&dev->rwsem);
+	} else {
+		down_read(&dev->rwsem);
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		entries[i].result = chardev_batch_one(dev, &entries[i]);
+		if (entries[i].op == CHARDEV_BATCH_WRITE && entries[i].result > 0) {
+			chardev_mark_dirty(dev, entries[i].offset, entries[i].result);
+		}
+	}
+
+	if (write) {
+		up_write(&dev->rwsem);
+	} else {
+		up_read(&dev->rwsem);
+	}
+
+	for (i = 0; write && i < batch.count; i++) {
+		if (entries[i].op == CHARDEV_BATCH_WRITE && entries[i].result > 0) {
+			chardev_wake_range(dev, entries[i].offset, entries[i].result);
+		}
+	}
+
+	if (copy_to_user(u64_to_user_ptr(batch.entries), entries, size) != 0) {
+		rc = -EFAULT;
+	}
+
+out:
+	kfree(entries);
+
+	return rc;
+}
+
+/*
+ * Transactions stage all data in kernel memory and build shadow copies of
+ * the affected pages without excluding readers, then publish them by
+ * swapping page pointers, so readers only ever wait for the swap itself.
+ * If write_gen moved while the shadows were built, they are rebuilt under
+ * the exclusive lock. While the
+ * buffer is mapped the pages cannot be replaced and the data is copied in
+ * place instead.
+ */
+struct chardev_txn_page {
+	unsigned long index;
+	struct page *page;
+};
+
+static int chardev_txn_cmp(const void *a, const void *b)
+{
+	const struct chardev_txn_page *x = a;
+	const struct chardev_txn_page *y = b;
+
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static int chardev_txn_check(struct chardev_data *dev,
+	struct chardev_batch_entry *entries, u32 count)
+{
+	u32 i;
+
+	for (i = 0; i < count; i++) {
+		if (entries[i].offset >= dev->size ||
+			entries[i].len > dev->size - entries[i].offset) {
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static void chardev_txn_apply(struct chardev_data *dev,
+	struct chardev_batch_entry *entries, u32 count, const u8 *data,
+	struct chardev_txn_page *pages, unsigned long nr)
+{
+	struct chardev_txn_page key;
+	struct chardev_txn_page *tp;
+	struct page *page;
+	u32 i;
+
+	for (i = 0; i < count; i++) {
+		loff_t pos = entries[i].offset;
+		size_t len = entries[i].len;
+
+		while (len) {
+			size_t off = offset_in_page(pos);
+			size_t n = min_t(size_t, len, PAGE_SIZE - off);
+
+			key.index = pos >> PAGE_SHIFT;
+			if (pages) {
+				tp = bsearch(&key, pages, nr, sizeof(*pages), chardev_txn_cmp);
+				page = tp->page;
+			} else {
+				page = chardev_page(dev, key.index);
+			}
+
+			memcpy(page_address(page) + off, data, n);
+			data += n;
+			pos += n;
+			len -= n;
+		}
+	}
+}
+
+static int chardev_txn_build(struct chardev_data *dev,
+	struct chardev_batch_entry *entries, u32 count, const u8 *data,
+	struct chardev_txn_page *pages, unsigned long nr)
+{
+	unsigned long i;
+	int rc;
+
+	rc = chardev_txn_check(dev, entries, count);
+	if (rc < 0) {
+		return rc;
+	}
+
+	/* Holes are filled first, so that publishing never allocates. */
+	for (i = 0; i < nr; i++) {
+		rc = chardev_populate(dev, (u64)pages[i].index << PAGE_SHIFT,
+			PAGE_SIZE);
+		if (rc < 0) {
+			return rc;
+		}
+
+		copy_page(page_address(pages[i].page),
+			page_address(chardev_page(dev, pages[i].index)));
+	}
+
+	chardev_txn_apply(dev, entries, count, data, pages, nr);
+
+	return 0;
+}
+
+static long chardev_commit(struct chardev_data *dev,
+	struct chardev_batch __user *ubatch)
+{
+	struct chardev_txn_page *pages = NULL;
+	struct chardev_batch_entry *entries;
+	struct chardev_batch batch;
+	unsigned long nr = 0;
+	unsigned long i, j;
+	size_t total = 0;
+	u8 *data = NULL;
+	bool mapped;
+	long rc = 0;
+	size_t size;
+	u8 *p;
+	u64 gen;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)) != 0) {
+		return -EFAULT;
+	}
+
+	if (!batch.count || batch.count > CHARDEV_BATCH_MAX || batch.flags) {
+		return -EINVAL;
+	}
+
+	size = batch.count * sizeof(*entries);
+	entries = memdup_user(u64_to_user_ptr(batch.entries), size);
+	if (IS_ERR(entries)) {
+		return PTR_ERR(entries);
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		if (entries[i].op != CHARDEV_BATCH_WRITE || !entries[i].len ||
+			entries[i].offset > CHARDEV_MAX_BUFSIZE) {
+			rc = -EINVAL;
+			goto out;
+		}
+
+		total += entries[i].len;
+		if (total > CHARDEV_TXN_MAX_BYTES) {
+			rc = -E2BIG;
+			goto out;
+		}
+
+		nr += ((entries[i].offset + entries[i].len - 1) >> PAGE_SHIFT) -
+			(entries[i].offset >> PAGE_SHIFT) + 1;
+	}
+
+	data = kvmalloc(total, GFP_KERNEL);
+	pages = kvcalloc(nr, sizeof(*pages), GFP_KERNEL);
+	if (!data || !pages) {
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0, j = 0, p = data; i < batch.count; i++) {
+		u64 first = entries[i].offset >> PAGE_SHIFT;
+		u64 last = (entries[i].offset + entries[i].len - 1) >> PAGE_SHIFT;
+
+		if (copy_from_user(p, u64_to_user_ptr(entries[i].addr),
+			entries[i].len) != 0) {
+			rc = -EFAULT;
+			goto out;
+		}
+		p += entries[i].len;
+
+		while (first <= last) {
+			pages[j++].index = first++;
+		}
+	}
+
+	sort(pages, nr, sizeof(*pages), chardev_txn_cmp, NULL);
+	for (i = 0, j = 0; i < nr; i++) {
+		if (!j || pages[j - 1].index != pages[i].index) {
+			pages[j++].index = pages[i].index;
+		}
+	}
+	nr = j;
+
+	for (i = 0; i < nr; i++) {
+		pages[i].page = chardev_alloc_page(dev, GFP_KERNEL_ACCOUNT);
+		if (!pages[i].page) {
+			rc = -ENOMEM;
+			goto out;
+		}
+	}
+
+	down_read(&dev->rwsem);
+	gen = atomic64_read(&dev->write_gen);
+	rc = chardev_txn_build(dev, entries, batch.count, data, pages, nr);
+	up_read(&dev->rwsem);
+	if (rc < 0) {
+		goto out;
+	}
+
+	down_write(&dev->rwsem);
+	mutex_lock(&dev->map_lock);
+
+	/* An unmap can drop the count at any time, decide once. */
+	mapped = atomic_read(&dev->mmap_count);
+	if (mapped) {
+		rc = chardev_txn_check(dev, entries, batch.count);
+		for (i = 0; !rc && i < batch.count; i++) {
+			rc = chardev_populate(dev, entries[i].offset, entries[i].len);
+		}
+		if (!rc) {
+			chardev_txn_apply(dev, entries, batch.count, data, NULL, 0);
+		}
+	} else if (gen != atomic64_read(&dev->write_gen)) {
+		rc = chardev_txn_build(dev, entries, batch.count, data, pages, nr);
+	}
+
+	if (!rc) {
+		if (!mapped) {
+			for (i = 0; i < nr; i++) {
+				pages[i].page = xa_store(&dev->pages, pages[i].index,
+					pages[i].page, GFP_KERNEL);
+			}
+		}
+
+		for (i = 0; i < batch.count; i++) {
+			chardev_mark_dirty(dev, entries[i].offset, entries[i].len);
+		}
+	}
+
+	mutex_unlock(&dev->map_lock);
+	up_write(&dev->rwsem);
+
+	if (!rc) {
+		for (i = 0; i < batch.count; i++) {
+			chardev_wake_range(dev, entries[i].offset, entries[i].len);
+			entries[i].result = entries[i].len;
+		}
+
+		if (copy_to_user(u64_to_user_ptr(batch.entries), entries, size) != 0) {
+			rc = -EFAULT;
+		}
+	}
+
+out:
+	for (i = 0; pages && i < nr; i++) {
+		if (pages[i].page) {
+			put_page(pages[i].page);
+		}
+	}
+	kvfree(pages);
+	kvfree(data);
+	kfree(entries);
+
+	return rc;
+}
+
+/*
+ * Atomic operations only need the page array to be stable, so they run
+ * under the shared lock. They are atomic against each other and against
+ * atomic instructions that other processes issue on a mapping of the
+ * buffer.
+ */
+static u64 chardev_atomic32(atomic_t *v, const struct chardev_atomic *a)
+{
+	u32 val = a->value;
+
+	switch (a->op) {
+		case CHARDEV_ATOMIC_CMPXCHG:
+			return (u32)atomic_cmpxchg(v, a->expected, val);
+		case CHARDEV_ATOMIC_XCHG:
+			return (u32)atomic_xchg(v, val);
+		case CHARDEV_ATOMIC_ADD:
+			return (u32)atomic_fetch_add(val, v);
+		case CHARDEV_ATOMIC_AND:
+			return (u32)atomic_fetch_and(val, v);
+		case CHARDEV_ATOMIC_OR:
+			return (u32)atomic_fetch_or(val, v);
+		default:
+			return (u32)atomic_fetch_xor(val, v);
+	}
+}
+
+static u64 chardev_atomic64(atomic64_t *v, const struct chardev_atomic *a)
+{
+	s64 val = a->value;
+
+	switch (a->op) {
+		case CHARDEV_ATOMIC_CMPXCHG:
+			return atomic64_cmpxchg(v, a->expected, val);
+		case CHARDEV_ATOMIC_XCHG:
+			return atomic64_xchg(v, val);
+		case CHARDEV_ATOMIC_ADD:
+			return atomic64_fetch_add(val, v);
+		case CHARDEV_ATOMIC_AND:
+			return atomic64_fetch_and(val, v);
+		case CHARDEV_ATOMIC_OR:
+			return atomic64_fetch_or(val, v);
+		default:
+			return atomic64_fetch_xor(val, v);
+	}
+}
+
+static bool chardev_atomic_lock(struct chardev_data *dev)
+{
+	down_read(&dev->rwsem);
+	if (!dev->replicas) {
+		return false;
+	}
+
+	up_read(&dev->rwsem);
+	down_write(&dev->rwsem);
+
+	return true;
+}
+
+static void chardev_atomic_unlock(struct chardev_data *dev, bool excl)
+{
+	if (excl) {
+		up_write(&dev->rwsem);
+	} else {
+		up_read(&dev->rwsem);
+	}
+}
+
+static long chardev_atomic(struct chardev_data *dev,
+	struct chardev_atomic __user *uarg)
+{
+	struct chardev_atomic a;
+	u64 expected;
+	bool excl;
+	void *ptr;
+	u64 old;
+
+	if (copy_from_user(&a, uarg, sizeof(a)) != 0) {
+		return -EFAULT;
+	}
+
+	if ((a.size != sizeof(u32) && a.size != sizeof(u64)) ||
+		a.op > CHARDEV_ATOMIC_XOR || !IS_ALIGNED(a.offset, a.size)) {
+		return -EINVAL;
+	}
+
+	excl = chardev_atomic_lock(dev);
+
+	if (a.offset >= dev->size || a.size > dev->size - a.offset) {
+		chardev_atomic_unlock(dev, excl);
+		return -EINVAL;
+	}
+
+	if (chardev_populate(dev, a.offset, a.size) < 0) {
+		chardev_atomic_unlock(dev, excl);
+		return -ENOMEM;
+	}
+
+	ptr = page_address(chardev_page(dev, a.offset >> PAGE_SHIFT)) +
+		offset_in_page(a.offset);
+
+	if (a.size == sizeof(u32)) {
+		old = chardev_atomic32(ptr, &a);
+		expected = (u32)a.expected;
+	} else {
+		old = chardev_atomic64(ptr, &a);
+		expected = a.expected;
+	}
+
+	if (a.op != CHARDEV_ATOMIC_CMPXCHG || old == expected) {
+		chardev_mark_dirty(dev, a.offset, a.size);
+		chardev_atomic_unlock(dev, excl);
+		chardev_wake_range(dev, a.offset, a.size);
+	} else {
+		chardev_atomic_unlock(dev, excl);
+	}
+
+	if (put_user(old, &uarg->result) != 0) {
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static long chardev_wait(struct chardev_data *dev,
+	struct chardev_wait __user *uarg)
+{
+	struct chardev_waiter w;
+	struct chardev_wait cw;
+	wait_queue_head_t *wq;
+	struct page *page;
+	long timeout;
+	void *ptr;
+	u64 val;
+	int rc;
+
+	if (copy_from_user(&cw, uarg, sizeof(cw)) != 0) {
+		return -EFAULT;
+	}
+
+	if ((cw.size != sizeof(u32) && cw.size != sizeof(u64)) || cw.flags ||
+		!IS_ALIGNED(cw.offset, cw.size)) {
+		return -EINVAL;
+	}
+
+	if (cw.timeout_ns < 0) {
+		timeout = MAX_SCHEDULE_TIMEOUT;
+	} else {
+		timeout = min_t(u64, nsecs_to_jiffies64(cw.timeout_ns),
+			MAX_SCHEDULE_TIMEOUT);
+	}
+
+	init_wait_entry(&w.wq_entry, 0);
+	w.wq_entry.func = chardev_wake_function;
+	w.dev = dev;
+	w.offset = cw.offset;
+	w.size = cw.size;
+	wq = chardev_wait_queue(dev, cw.offset >> 3);
+
+	/* Counted before the barrier in prepare_to_wait() orders the load. */
+	atomic_inc(&chardev_waiters);
+
+	for (;;) {
+		down_read(&dev->rwsem);
+
+		if (cw.offset >= dev->size || cw.size > dev->size - cw.offset) {
+			up_read(&dev->rwsem);
+			rc = -EINVAL;
+			break;
+		}
+
+		/* Queued and ordered by the barrier before the word is loaded. */
+		prepare_to_wait(wq, &w.wq_entry, TASK_INTERRUPTIBLE);
+
+		page = chardev_page(dev, cw.offset >> PAGE_SHIFT);
+		ptr = page ? page_address(page) + offset_in_page(cw.offset) : NULL;
+		if (cw.size == sizeof(u32)) {
+			val = ptr ? READ_ONCE(*(u32 *)ptr) : 0;
+			cw.expected = (u32)cw.expected;
+		} else {
+			val = ptr ? READ_ONCE(*(u64 *)ptr) : 0;
+		}
+
+		up_read(&dev->rwsem);
+
+		if (val != cw.expected) {
+			rc = 0;
+			break;
+		}
+
+		if (signal_pending(current)) {
+			rc = -ERESTARTSYS;
+			break;
+		}
+
+		if (!timeout) {
+			rc = -ETIMEDOUT;
+			break;
+		}
+
+		timeout = schedule_timeout(timeout);
+	}
+
+	finish_wait(wq, &w.wq_entry);
+	atomic_dec(&chardev_waiters);
+
+	return rc;
+}
+
+/*
+ * Atomic operations stamp pages under the shared lock as well, but publish
+ * each generation together with its stamps under gen_lock, so every
+ * generation up to the one returned has stamped its pages by the time they
+ * are scanned. Later stamps seen by the scan are reported early and again
+ * by the next call.
+ */
+static long chardev_changes(struct chardev_data *dev,
+	struct chardev_changes __user *uarg)
+{
+	struct chardev_changes ch;
+	struct chardev_range *ranges;
+	struct page *page;
+	unsigned long idx;
+	u32 count = 0;
+	long rc = 0;
+
+	if (copy_from_user(&ch, uarg, sizeof(ch)) != 0) {
+		return -EFAULT;
+	}
+
+	if (!ch.count || ch.count > CHARDEV_CHANGES_MAX || ch.flags) {
+		return -EINVAL;
+	}
+
+	ranges = kvmalloc_array(ch.count, sizeof(*ranges), GFP_KERNEL);
+	if (!ranges) {
+		return -ENOMEM;
+	}
+
+	down_read(&dev->rwsem);
+
+	spin_lock(&dev->gen_lock);
+	ch.gen = atomic64_read(&dev->write_gen);
+	spin_unlock(&dev->gen_lock);
+
+	if (atomic64_read(&dev->all_gen) > ch.since) {
+		ranges[0].offset = 0;
+		ranges[0].len = dev->size;
+		count = 1;
+		goto out;
+	}
+
+	xa_for_each(&dev->pages, idx, page) {
+		u64 pos = (u64)idx << PAGE_SHIFT;
+
+		if (page_private(page) <= ch.since) {
+			continue;
+		}
+
+		/* Extend the last range over everything else that changed. */
+		if (count && (ranges[count - 1].offset + ranges[count - 1].len == pos ||
+			count == ch.count)) {
+			ranges[count - 1].len = pos + PAGE_SIZE - ranges[count - 1].offset;
+			continue;
+		}
+
+		ranges[count].offset = pos;
+		ranges[count].len = PAGE_SIZE;
+		count++;
+	}
+
+	if (count) {
+		ranges[count - 1].len = min_t(u64, ranges[count - 1].len,
+			dev->size - ranges[count - 1].offset);
+	}
+
+out:
+	up_read(&dev->rwsem);
+
+	ch.count = count;
+	if (copy_to_user(u64_to_user_ptr(ch.ranges), ranges,
+		count * sizeof(*ranges)) != 0 ||
+		copy_to_user(uarg, &ch, sizeof(ch)) != 0) {
+		rc = -EFAULT;
+	}
+
+	kvfree(ranges);
+
+	return rc;
+}
+
+static long chardev_ioctl(struct file *filp, unsigned int cmd,
+	unsigned long arg)
+{
+	struct chardev_data *dev = filp->private_data;
+
+	switch (cmd) {
+		case CHARDEV_IOC_BATCH:
+			return chardev_batch(dev, (void __user *)arg);
+		case CHARDEV_IOC_COMMIT:
+			return chardev_commit(dev, (void __user *)arg);
+		case CHARDEV_IOC_ATOMIC:
+			return chardev_atomic(dev, (void __user *)arg);
+		case CHARDEV_IOC_WAIT:
+			return chardev_wait(dev, (void __user *)arg);
+		case CHARDEV_IOC_CHANGES:
+			return chardev_changes(dev, (void __user *)arg);
+		default:
+			return -ENOTTY;
+	}
+}
+
+/* Data is reported at page granularity, a hole is implied at the end. */
+static loff_t chardev_seek_data(struct chardev_data *dev, loff_t off,
+	int whence)
+{
+	unsigned long nr = DIV_ROUND_UP(dev->size, PAGE_SIZE);
+	unsigned long idx = off >> PAGE_SHIFT;
+
+	if (off < 0 || off >= dev->size) {
+		return -ENXIO;
+	}
+
+	if (whence == SEEK_DATA) {
+		if (!xa_find(&dev->pages, &idx, nr - 1, XA_PRESENT)) {
+			return -ENXIO;
+		}
+	} else {
+		while (idx < nr && chardev_page(dev, idx)) {
+			idx++;
+		}
+	}
+
+	if (idx != off >> PAGE_SHIFT) {
+		off = (loff_t)idx << PAGE_SHIFT;
+	}
+
+	return min_t(loff_t, off, dev->size);
+}
+
+/*
+ * f_pos is per-file state serialised by the VFS, and I/O works on the
+ * position passed in the kiocb, so seeking only needs the device lock to
+ * look for data and holes.
+ */
+static loff_t chardev_lseek(struct file *filp, loff_t off, int whence)
+{
+	struct chardev_data *dev = filp->private_data;
+
+	switch (whence) {
+		case SEEK_DATA:
+		case SEEK_HOLE:
+			down_read(&dev->rwsem);
+			off = chardev_seek_data(dev, off, whence);
+			up_read(&dev->rwsem);
+			if (off < 0) {
+				return off;
+			}
+			return vfs_setpos(filp, off, CHARDEV_MAX_BUFSIZE);
+		default:
+			return fixed_size_llseek(filp, off, whence, READ_ONCE(dev->size));
+	}
+}
+
+static void chardev_vma_open(struct vm_area_struct *vma)
+{
+	struct chardev_data *dev = vma->vm_private_data;
+
+	atomic_inc(&dev->mmap_count);
+}
+
+static void chardev_vma_close(struct vm_area_struct *vma)
+{
+	struct chardev_data *dev = vma->vm_private_data;
+
+	/*
+	 * Stores through the mapping are not tracked, assume it changed all.
+	 * This runs under the mm's mmap_lock, so the device lock cannot be
+	 * taken to drop the replicas, which are flagged stale before reads
+	 * can see the last mapping go.
+	 */
+	chardev_bump_all_gen(dev);
+	set_bit(CHARDEV_REPLICAS_STALE, &dev->flags);
+	smp_mb__before_atomic();
+	atomic_dec(&dev->mmap_count);
+}
+
+/*
+ * The buffer cannot be resized while any mapping exists, so pages are never
+ * removed for the lifetime of the vma and no locking is needed here.
+ */
+static vm_fault_t chardev_vma_fault(struct vm_fault *vmf)
+{
+	struct chardev_data *dev = vmf->vma->vm_private_data;
+	struct page *page;
+
+	if (vmf->pgoff >= DIV_ROUND_UP(dev->size, PAGE_SIZE)) {
+		return VM_FAULT_SIGBUS;
+	}
+
+	if (chardev_populate(dev, (u64)vmf->pgoff << PAGE_SHIFT, PAGE_SIZE) < 0) {
+		return VM_FAULT_OOM;
+	}
+
+	page = chardev_page(dev, vmf->pgoff);
+	get_page(page);
+	vmf->page = page;
+
+	return 0;
+}
+
+static const struct vm_operations_struct chardev_vm_ops = {
+	.open = chardev_vma_open,
+	.close = chardev_vma_close,
+	.fault = chardev_vma_fault,
+};
+
+/*
+ * Called with the mm's mmap_lock held, which the read and write paths take
+ * under the device lock when they fault in user memory. A first mapping is
+ * therefore only serialised against the paths that need the buffer to stay
+ * unmapped, which check mmap_count under map_lock and take nothing inside it.
+ */
+static int chardev_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct chardev_data *dev = filp->private_data;
+	unsigned long nr;
+
+	mutex_lock(&dev->map_lock);
+
+	nr = DIV_ROUND_UP(dev->size, PAGE_SIZE);
+	if (vma->vm_pgoff >= nr || vma_pages(vma) > nr - vma->vm_pgoff) {
+		mutex_unlock(&dev->map_lock);
+		return -EINVAL;
+	}
+
+	vma->vm_ops = &chardev_vm_ops;
+	vma->vm_private_data = dev;
+	vm_flags_set(vma, VM_DONTEXPAND);
+	chardev_vma_open(vma);
+
+	mutex_unlock(&dev->map_lock);
+
+	return 0;
+}
+
+static int chardev_open(struct inode *inode, struct file *filp)
+{
+	const struct chardev_mode *mode;
+	struct chardev_data *dev;
+	int rc = 0;
+
+	dev = container_of(inode->i_cdev, struct chardev_data, cdev);
+
+	down_read(&dev->rwsem);
+	mode = dev->mode;
+	atomic_inc(&dev->open_count);
+	up_read(&dev->rwsem);
+
+	filp->private_data = dev;
+	filp->f_mode |= FMODE_NOWAIT | FMODE_ATOMIC_POS;
+	replace_fops(filp, fops_get(mode->fops));
+
+	if (mode->open) {
+		rc = mode->open(inode, filp);
+		if (rc < 0) {
+			atomic_dec(&dev->open_count);
+		}
+	}
+
+	return rc;
+}
+
+static int chardev_release(struct inode *inode, struct file *filp)
+{
+	struct chardev_data *dev = filp->private_data;
+
+	atomic_dec(&dev->open_count);
+
+	return 0;
+}
+
+static int chardev_fifo_reset(struct chardev_data *dev)
+{
+	if (dev->size < 2) {
+		return -EINVAL;
+	}
+
+	dev->head = 0;
+	dev->tail = 0;
+
+	return 0;
+}
+
+static int chardev_stream_open(struct inode *inode, struct file *filp)
+{
+	return stream_open(inode, filp);
+}
+
+/*
+ * Take the device lock and wait until the ring holds at least min bytes,
+ * or has room for them. Blocked readers are always woken one at a time.
+ * Writers waiting for more than one byte wait non-exclusively, as a wakeup
+ * that frees too little space for one writer may still suit another.
+ */
+static int chardev_fifo_wait_used(struct chardev_data *dev,
+	struct kiocb *iocb, size_t min)
+{
+	int rc;
+
+	rc = chardev_down_write(dev, iocb);
+	if (rc < 0) {
+		return rc;
+	}
+
+	while (chardev_ring_used(dev) < min) {
+		up_write(&dev->rwsem);
+
+		if (chardev_nonblock(iocb)) {
+			return -EAGAIN;
+		}
+
+		if (wait_event_interruptible_exclusive(dev->read_wq,
+			chardev_ring_used(dev) >= min)) {
+			return -ERESTARTSYS;
+		}
+
+		down_write(&dev->rwsem);
+	}
+
+	return 0;
+}
+
+static int chardev_fifo_wait_free(struct chardev_data *dev,
+	struct kiocb *iocb, size_t min)
+{
+	int rc;
+
+	rc = chardev_down_write(dev, iocb);
+	if (rc < 0) {
+		return rc;
+	}
+
+	while (chardev_ring_free(dev) < min) {
+		up_write(&dev->rwsem);
+
+		if (chardev_nonblock(iocb)) {
+			return -EAGAIN;
+		}
+
+		if (min == 1) {
+			rc = wait_event_interruptible_exclusive(dev->write_wq,
+				chardev_ring_free(dev) >= min);
+		} else {
+			rc = wait_event_interruptible(dev->write_wq,
+				chardev_ring_free(dev) >= min);
+		}
+		if (rc) {
+			return -ERESTARTSYS;
+		}
+
+		down_write(&dev->rwsem);
+	}
+
+	return 0;
+}
+
+static ssize_t chardev_fifo_write_iter(struct kiocb *iocb,
+	struct iov_iter *from)
+{
+	struct chardev_data *dev = iocb->ki_filp->private_data;
+	size_t count = iov_iter_count(from);
+	size_t copied;
+	int rc;
+
+	if (!count) {
+		return 0;
+	}
+
+	rc = chardev_fifo_wait_free(dev, iocb, 1);
+	if (rc < 0) {
+		return rc;
+	}
+
+	count = min(count, chardev_ring_free(dev));
+	copied = chardev_ring_from_iter(dev, dev->head, from, count);
+	if (!copied) {
+		up_write(&dev->rwsem);
+		return -EFAULT;
+	}
+
+	WRITE_ONCE(dev->head, chardev_ring_advance(dev, dev->head, copied));
+
+	if (chardev_ring_free(dev)) {
+		wake_up_interruptible_poll(&dev->write_wq, EPOLLOUT | EPOLLWRNORM);
+	}
+
+	up_write(&dev->rwsem);
+
+	wake_up_interruptible_poll(&dev->read_wq, EPOLLIN | EPOLLRDNORM);
+
+	return copied;
+}
+
+static ssize_t chardev_fifo_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct chardev_data *dev = iocb->ki_filp->private_data;
+	size_t count = iov_iter_count(to);
+	size_t copied;
+	int rc;
+
+	if (!count) {
+		return 0;
+	}
+
+	rc = chardev_fifo_wait_used(dev, iocb, 1);
+	if (rc < 0) {
+		return rc;
+	}
+
+	count = min(count, chardev_ring_used(dev));
+	copied = chardev_ring_to_iter(dev, dev->tail, to, count);
+	if (!copied) {
+		up_write(&dev->rwsem);
+		return -EFAULT;
+	}
+
+	WRITE_ONCE(dev->tail, chardev_ring_advance(dev, dev->tail, copied));
+
+	if (chardev_ring_used(dev)) {
+		wake_up_interruptible_poll(&dev->read_wq, EPOLLIN | EPOLLRDNORM);
+	}
+
+	up_write(&dev->rwsem);
+
+	wake_up_interruptible_poll(&dev->write_wq, EPOLLOUT | EPOLLWRNORM);
+
+	return copied;
+}
+
+static __poll_t chardev_fifo_poll(struct file *filp, poll_table *wait)
+{
+	struct chardev_data *dev = filp->private_data;
+	__poll_t mask = 0;
+
+	poll_wait(filp, &dev->read_wq, wait);
+	poll_wait(filp, &dev->write_wq, wait);
+
+	if (chardev_ring_used(dev)) {
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+
+	if (chardev_ring_free(dev)) {
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	}
+
+	return mask;
+}
+
+/*
+ * Record mode reuses the fifo ring, framing each write() as a u32 length
+ * followed by the payload. A record is only published once it has been
+ * copied in full, and read() returns exactly one record or -EMSGSIZE if
+ * the caller's buffer is too small, leaving the record queued.
+ */
+static int chardev_record_reset(struct chardev_data *dev)
+{
+	if (dev->size <= sizeof(u32) + 1) {
+		return -EINVAL;
+	}
+
+	return chardev_fifo_reset(dev);
+}
+
+static ssize_t chardev_record_write_iter(struct kiocb *iocb,
+	struct iov_iter *from)
+{
+	struct chardev_data *dev = iocb->ki_filp->private_data;
+	size_t count = iov_iter_count(from);
+	size_t pos;
+	u32 len;
+	int rc;
+
+	if (!count) {
+		return 0;
+	}
+
+	if (count > dev->size - 1 - sizeof(len)) {
+		return -EMSGSIZE;
+	}
+
+	rc = chardev_fifo_wait_free(dev, iocb, sizeof(len) + count);
+	if (rc < 0) {
+		return rc;
+	}
+
+	len = count;
+	chardev_ring_put(dev, dev->head, &len, sizeof(len));
+	pos = chardev_ring_advance(dev, dev->head, sizeof(len));
+	if (chardev_ring_from_iter(dev, pos, from, count) != count) {
+		up_write(&dev->rwsem);
+		return -EFAULT;
+	}
+
+	WRITE_ONCE(dev->head, chardev_ring_advance(dev, pos, count));
+
+	if (chardev_ring_free(dev) > sizeof(len)) {
+		wake_up_interruptible_poll(&dev->write_wq, EPOLLOUT | EPOLLWRNORM);
+	}
+
+	up_write(&dev->rwsem);
+
+	wake_up_interruptible_poll(&dev->read_wq, EPOLLIN | EPOLLRDNORM);
+
+	return count;
+}
+
+static ssize_t chardev_record_read_iter(struct kiocb *iocb,
+	struct iov_iter *to)
+{
+	struct chardev_data *dev = iocb->ki_filp->private_data;
+	size_t pos;
+	u32 len;
+	int rc;
+
+	rc = chardev_fifo_wait_used(dev, iocb, sizeof(len));
+	if (rc < 0) {
+		return rc;
+	}
+
+	chardev_ring_get(dev, dev->tail, &len, sizeof(len));
+	if (len > iov_iter_count(to)) {
+		up_write(&dev->rwsem);
+		return -EMSGSIZE;
+	}
+
+	pos = chardev_ring_advance(dev, dev->tail, sizeof(len));
+	if (chardev_ring_to_iter(dev, pos, to, len) != len) {
+		up_write(&dev->rwsem);
+		return -EFAULT;
+	}
+
+	WRITE_ONCE(dev->tail, chardev_ring_advance(dev, pos, len));
+
+	if (chardev_ring_used(dev)) {
+		wake_up_interruptible_poll(&dev->read_wq, EPOLLIN | EPOLLRDNORM);
+	}
+
+	up_write(&dev->rwsem);
+
+	wake_up_interruptible_poll(&dev->write_wq, EPOLLOUT | EPOLLWRNORM);
+
+	return len;
+}
+
+static __poll_t chardev_record_poll(struct file *filp, poll_table *wait)
+{
+	struct chardev_data *dev = filp->private_data;
+	__poll_t mask = 0;
+
+	poll_wait(filp, &dev->read_wq, wait);
+	poll_wait(filp, &dev->write_wq, wait);
+
+	if (chardev_ring_used(dev)) {
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+
+	if (chardev_ring_free(dev) > sizeof(u32)) {
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	}
+
+	return mask;
+}
+
+/*
+ * Broadcast mode turns the buffer into a ring that the writer overwrites
+ * without ever waiting for readers. dev->seq counts the bytes ever written
+ * and every open file follows the stream with its own cursor, so each
+ * subscriber sees all data written after it opened the device. A reader
+ * that falls more than a full ring behind gets -EOVERFLOW once and resumes
+ * from the oldest data still held.
+ */
+static int chardev_bcast_reset(struct chardev_data *dev)
+{
+	dev->head = 0;
+	dev->seq = 0;
+
+	return 0;
+}
+
+static struct chardev_file *chardev_file_alloc(struct inode *inode,
+	struct file *filp)
+{
+	struct chardev_file *cf;
+
+	cf = kzalloc(sizeof(*cf), GFP_KERNEL);
+	if (!cf) {
+		return NULL;
+	}
+
+	cf->dev = filp->private_data;
+	mutex_init(&cf->lock);
+
+	filp->private_data = cf;
+	stream_open(inode, filp);
+
+	return cf;
+}
+
+static int chardev_file_open(struct inode *inode, struct file *filp)
+{
+	return chardev_file_alloc(inode, filp) ? 0 : -ENOMEM;
+}
+
+static int chardev_file_release(struct inode *inode, struct file *filp)
+{
+	struct chardev_file *cf = filp->private_data;
+
+	filp->private_data = cf->dev;
+	kfree(cf);
+
+	return chardev_release(inode, filp);
+}
+
+static int chardev_file_lock(struct chardev_file *cf, struct kiocb *iocb)
+{
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		return mutex_trylock(&cf->lock) ? 0 : -EAGAIN;
+	}
+
+	return mutex_lock_interruptible(&cf->lock) ? -ERESTARTSYS : 0;
+}
+
+static int chardev_bcast_open(struct inode *inode, struct file *filp)
+{
+	struct chardev_data *dev = filp->private_data;
+	struct chardev_file *cf;
+
+	cf = chardev_file_alloc(inode, filp);
+	if (!cf) {
+		return -ENOMEM;
+	}
+
+	down_read(&dev->rwsem);
+	cf->seq = dev->seq;
+	cf->pos = dev->head;
+	up_read(&dev->rwsem);
+
+	return 0;
+}
+
+static ssize_t chardev_bcast_write_iter(struct kiocb *iocb,
+	struct iov_iter *from)
+{
+	struct chardev_file *cf = iocb->ki_filp->private_data;
+	struct chardev_data *dev = cf->dev;
+	size_t count = iov_iter_count(from);
+	size_t copied;
+	int rc;
+
+	if (!count) {
+		return 0;
+	}
+
+	rc = chardev_down_write(dev, iocb);
+	if (rc < 0) {
+		return rc;
+	}
+
+	count = min(count, dev->size);
+	copied = chardev_ring_from_iter(dev, dev->head, from, count);
+	if (!copied) {
+		up_write(&dev->rwsem);
+		return -EFAULT;
+	}
+
+	dev->head = chardev_ring_advance(dev, dev->head, copied);
+	WRITE_ONCE(dev->seq, dev->seq + copied);
+
+	up_write(&dev->rwsem);
+
+	if (wq_has_sleeper(&dev->read_wq)) {
+		wake_up_interruptible_poll(&dev->read_wq, EPOLLIN | EPOLLRDNORM);
+	}
+
+	return copied;
+}
+
+static ssize_t chardev_bcast_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct chardev_file *cf = iocb->ki_filp->private_data;
+	struct chardev_data *dev = cf->dev;
+	size_t count = iov_iter_count(to);
+	size_t copied;
+	u64 avail;
+	int rc;
+
+	if (!count) {
+		return 0;
+	}
+
+	rc = chardev_file_lock(cf, iocb);
+	if (rc < 0) {
+		return rc;
+	}
+
+	rc = chardev_down_read(dev, iocb);
+	if (rc < 0) {
+		goto out;
+	}
+
+	while (dev->seq == cf->seq) {
+		up_read(&dev->rwsem);
+
+		if (chardev_nonblock(iocb)) {
+			rc = -EAGAIN;
+			goto out;
+		}
+
+		if (wait_event_interruptible(dev->read_wq,
+			READ_ONCE(dev->seq) != cf->seq)) {
+			rc = -ERESTARTSYS;
+			goto out;
+		}
+
+		down_read(&dev->rwsem);
+	}
+
+	avail = dev->seq - cf->seq;
+	if (avail > dev->size) {
+		cf->seq = dev->seq - dev->size;
+		cf->pos = dev->head;
+		up_read(&dev->rwsem);
+		rc = -EOVERFLOW;
+		goto out;
+	}
+
+	count = min_t(u64, count, avail);
+	copied = chardev_ring_to_iter(dev, cf->pos, to, count);
+	if (!copied) {
+		up_read(&dev->rwsem);
+		rc = -EFAULT;
+		goto out;
+	}
+
+	cf->seq += copied;
+	cf->pos = chardev_ring_advance(dev, cf->pos, copied);
+
+	up_read(&dev->rwsem);
+
+	mutex_unlock(&cf->lock);
+
+	return copied;
+
+out:
+	mutex_unlock(&cf->lock);
+
+	return rc;
+}
+
+static __poll_t chardev_bcast_poll(struct file *filp, poll_table *wait)
+{
+	struct chardev_file *cf = filp->private_data;
+	struct chardev_data *dev = cf->dev;
+	__poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+	poll_wait(filp, &dev->read_wq, wait);
+
+	if (READ_ONCE(dev->seq) != READ_ONCE(cf->seq)) {
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+
+	return mask;
+}
+
+/*
+ * The per-CPU modes split the buffer into one shard per possible CPU. Each
+ * shard is a ring of struct chardev_record entries, each followed by its
+ * payload and padded to CHARDEV_RECORD_ALIGN, so that writers on different
+ * CPUs only ever take their own shard's lock. Records never wrap: the end
+ * of a shard is skipped with a padding entry, or implicitly when it is too
+ * short to hold one.
+ */
+#define CHARDEV_SHARD_PAD U32_MAX
+#define CHARDEV_SHARD_MIN 256
+#define CHARDEV_SHARD_PEEK 16
+#define CHARDEV_SHARDS_BATCH (64 << 10)
+
+static int chardev_shards_reset(struct chardev_data *dev)
+{
+	size_t shard_size;
+	unsigned int cpu;
+
+	shard_size = round_down(dev->size / nr_cpu_ids, CHARDEV_RECORD_ALIGN);
+	if (shard_size < CHARDEV_SHARD_MIN) {
+		return -EINVAL;
+	}
+
+	if (!dev->shards) {
+		dev->shards = alloc_percpu_gfp(struct chardev_shard,
+			GFP_KERNEL_ACCOUNT);
+		if (!dev->shards) {
+			return -ENOMEM;
+		}
+
+		for_each_possible_cpu(cpu) {
+			mutex_init(&per_cpu_ptr(dev->shards, cpu)->lock);
+		}
+	}
+
+	dev->shard_size = shard_size;
+
+	for_each_possible_cpu(cpu) {
+		struct chardev_shard *sh = per_cpu_ptr(dev->shards, cpu);
+
+		sh->cpu = cpu;
+		sh->base = cpu * shard_size;
+		sh->head = 0;
+		sh->tail = 0;
+		sh->used = 0;
+	}
+
+	return 0;
+}
+
+static void chardev_shards_leave(struct chardev_data *dev)
+{
+	free_percpu(dev->shards);
+	dev->shards = NULL;
+}
+
+static int chardev_shard_lock(struct chardev_shard *sh, struct kiocb *iocb)
+{
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		return mutex_trylock(&sh->lock) ? 0 : -EAGAIN;
+	}
+
+	return mutex_lock_interruptible(&sh->lock) ? -ERESTARTSYS : 0;
+}
+
+static void chardev_shard_advance(struct chardev_data *dev, size_t *pos,
+	size_t len)
+{
+	*pos += len;
+	if (*pos == dev->shard_size) {
+		*pos = 0;
+	}
+}
+
+/*
+ * Return the size of the entry at pos in the shard, which is the padding
+ * up to the end of the shard if no record header fits there.
+ */
+static size_t chardev_shard_entry(struct chardev_data *dev,
+	struct chardev_shard *sh, size_t pos, struct chardev_record *rec)
+{
+	size_t room = dev->shard_size - pos;
+
+	if (room < sizeof(*rec)) {
+		rec->len = CHARDEV_SHARD_PAD;
+		return room;
+	}
+
+	chardev_ring_get(dev, sh->base + pos, rec, sizeof(*rec));
+	if (rec->len == CHARDEV_SHARD_PAD) {
+		return room;
+	}
+
+	return CHARDEV_RECORD_SIZE(rec->len);
+}
+
+static void chardev_shard_pop(struct chardev_data *dev,
+	struct chardev_shard *sh)
+{
+	struct chardev_record rec;
+	size_t len;
+
+	len = chardev_shard_entry(dev, sh, sh->tail, &rec);
+	chardev_shard_advance(dev, &sh->tail, len);
+	sh->used -= len;
+}
+
+/*
+ * Look at the oldest record of a shard, dropping any padding in front of
+ * it. Returns false if the shard holds no records.
+ */
+static bool chardev_shard_peek(struct chardev_data *dev,
+	struct chardev_shard *sh, struct chardev_record *rec)
+{
+	while (sh->used) {
+		chardev_shard_entry(dev, sh, sh->tail, rec);
+		if (rec->len != CHARDEV_SHARD_PAD) {
+			return true;
+		}
+		chardev_shard_pop(dev, sh);
+	}
+
+	return false;
+}
+
+/*
+ * Make need contiguous bytes available at the shard's head. When the shard
+ * is full the oldest records are dropped if overwrite is set, otherwise
+ * -ENOSPC is returned and the caller has to wait for a reader.
+ */
+static int chardev_shard_reserve(struct chardev_data *dev,
+	struct chardev_shard *sh, size_t need, bool overwrite)
+{
+	struct chardev_record pad = { .len = CHARDEV_SHARD_PAD };
+	size_t room;
+
+	for (;;) {
+		if (!sh->used) {
+			sh->head = 0;
+			sh->tail = 0;
+		}
+
+		if (!sh->used || sh->head > sh->tail) {
+			room = dev->shard_size - sh->head;
+			if (room >= need) {
+				return 0;
+			}
+
+			if (room >= sizeof(pad)) {
+				chardev_ring_put(dev, sh->base + sh->head, &pad, sizeof(pad));
+			}
+			sh->used += room;
+			sh->head = 0;
+			continue;
+		}
+
+		if (sh->tail - sh->head >= need) {
+			return 0;
+		}
+
+		if (!overwrite) {
+			return -ENOSPC;
+		}
+
+		chardev_shard_pop(dev, sh);
+	}
+}
+
+static ssize_t chardev_shard_append(struct chardev_data *dev,
+	struct chardev_shard *sh, struct iov_iter *from, size_t count,
+	bool overwrite)
+{
+	static const u8 zero[CHARDEV_RECORD_ALIGN];
+	size_t need = CHARDEV_RECORD_SIZE(count);
+	struct chardev_record rec;
+	size_t pos;
+	int rc;
+
+	rc = chardev_shard_reserve(dev, sh, need, overwrite);
+	if (rc < 0) {
+		return rc;
+	}
+
+	pos = sh->base + sh->head;
+	if (chardev_copy_from_iter(dev, pos + sizeof(rec), from, count) != count) {
+		return -EFAULT;
+	}
+
+	rec.len = count;
+	rec.cpu = sh->cpu;
+	rec.timestamp = ktime_get_ns();
+	chardev_ring_put(dev, pos, &rec, sizeof(rec));
+	chardev_ring_put(dev, pos + sizeof(rec) + count, zero,
+		need - sizeof(rec) - count);
+
+	chardev_shard_advance(dev, &sh->head, need);
+	sh->used += need;
+
+	return count;
+}
+
+/*
+ * Readers merge the shards in timestamp order. A read looks at up to
+ * CHARDEV_SHARD_PEEK of the oldest records of each shard under its lock,
+ * picks the oldest of all of them that fit, and then takes each shard's
+ * lock once more to move its picks into a bounce buffer. They are copied
+ * to the reader in order with no lock held. A shard with more records than
+ * were looked at bounds the picks by the newest one seen, as the rest may
+ * be older than another shard's. A non-blocking read skips shards that
+ * became busy in between, leaving their records for the next read.
+ */
+struct chardev_shard_ref {
+	u64 timestamp;
+	unsigned int cpu;
+	size_t len;
+};
+
+struct chardev_shard_run {
+	unsigned int nr;
+	u64 last;
+	size_t start;
+	size_t end;
+};
+
+static int chardev_shard_ref_cmp(const void *a, const void *b)
+{
+	const struct chardev_shard_ref *x = a;
+	const struct chardev_shard_ref *y = b;
+
+	if (x->timestamp != y->timestamp) {
+		return x->timestamp < y->timestamp ? -1 : 1;
+	}
+
+	return x->cpu < y->cpu ? -1 : x->cpu > y->cpu;
+}
+
+/*
+ * Collect the oldest records of every shard no newer than limit into refs,
+ * lowering *cutoff to the newest one seen of each shard that has more.
+ */
+static ssize_t chardev_shards_peek(struct chardev_data *dev,
+	struct kiocb *iocb, u64 limit, struct chardev_shard_ref *refs,
+	u64 *cutoff)
+{
+	struct chardev_record rec;
+	unsigned int cpu;
+	size_t nr = 0;
+	size_t left;
+	size_t pos;
+	size_t len;
+	int rc;
+
+	for_each_possible_cpu(cpu) {
+		struct chardev_shard *sh = per_cpu_ptr(dev->shards, cpu);
+		unsigned int n = 0;
+
+		if (!READ_ONCE(sh->used)) {
+			continue;
+		}
+
+		rc = chardev_shard_lock(sh, iocb);
+		if (rc < 0) {
+			return rc;
+		}
+
+		pos = sh->tail;
+		left = sh->used;
+		while (left && n < CHARDEV_SHARD_PEEK) {
+			len = chardev_shard_entry(dev, sh, pos, &rec);
+			if (rec.len != CHARDEV_SHARD_PAD) {
+				if (rec.timestamp > limit) {
+					left = 0;
+					break;
+				}
+
+				refs[nr].timestamp = rec.timestamp;
+				refs[nr].cpu = cpu;
+				refs[nr].len = CHARDEV_RECORD_SIZE(rec.len);
+				nr++;
+				n++;
+			}
+
+			chardev_shard_advance(dev, &pos, len);
+			left -= len;
+		}
+
+		mutex_unlock(&sh->lock);
+
+		if (left) {
+			*cutoff = min(*cutoff, refs[nr - 1].timestamp);
+		}
+	}
+
+	return nr;
+}
+
+/*
+ * Move the picks of every shard into the bounce buffer, stopping early at
+ * records another reader took first. Returns -EAGAIN if a shard was busy.
+ */
+static int chardev_shards_take(struct chardev_data *dev,
+	struct kiocb *iocb, struct chardev_shard_run *runs, void *bounce,
+	size_t size)
+{
+	struct chardev_record rec;
+	unsigned int cpu;
+	unsigned int n;
+	size_t pos = 0;
+	size_t len;
+	int rc = 0;
+
+	for_each_possible_cpu(cpu) {
+		struct chardev_shard *sh = per_cpu_ptr(dev->shards, cpu);
+		struct chardev_shard_run *run = &runs[cpu];
+
+		run->start = pos;
+		run->end = pos;
+		if (!run->nr) {
+			continue;
+		}
+
+		if (iocb->ki_flags & IOCB_NOWAIT) {
+			if (!mutex_trylock(&sh->lock)) {
+				rc = -EAGAIN;
+				continue;
+			}
+		} else {
+			mutex_lock(&sh->lock);
+		}
+
+		for (n = 0; n < run->nr && chardev_shard_peek(dev, sh, &rec) &&
+			rec.timestamp <= run->last; n++) {
+			len = CHARDEV_RECORD_SIZE(rec.len);
+			if (len > size - pos) {
+				break;
+			}
+
+			chardev_ring_get(dev, sh->base + sh->tail, bounce + pos, len);
+			chardev_shard_pop(dev, sh);
+			pos += len;
+		}
+
+		mutex_unlock(&sh->lock);
+
+		run->end = pos;
+	}
+
+	return rc;
+}
+
+/*
+ * Move the oldest records across all shards no newer than limit to the
+ * reader. Returns the bytes read, 0 only if no shard holds a record up to
+ * limit, or -EMSGSIZE if the oldest does not fit in the iterator.
+ */
+static ssize_t chardev_shards_read(struct chardev_data *dev,
+	struct kiocb *iocb, struct iov_iter *to, u64 limit)
+{
+	size_t count = iov_iter_count(to);
+	size_t budget = min_t(size_t, count, CHARDEV_SHARDS_BATCH);
+	struct chardev_shard_run *runs;
+	struct chardev_shard_ref *refs;
+	struct chardev_shard_run *run;
+	struct chardev_record rec;
+	void *bounce = NULL;
+	u64 cutoff = limit;
+	size_t total = 0;
+	size_t done = 0;
+	size_t len;
+	ssize_t nr;
+	ssize_t i;
+	int rc;
+
+	refs = kvmalloc_array(nr_cpu_ids * CHARDEV_SHARD_PEEK, sizeof(*refs),
+		GFP_KERNEL);
+	runs = kvcalloc(nr_cpu_ids, sizeof(*runs), GFP_KERNEL);
+	if (!refs || !runs) {
+		nr = -ENOMEM;
+		goto out;
+	}
+
+retry:
+	nr = chardev_shards_peek(dev, iocb, limit, refs, &cutoff);
+	if (nr <= 0) {
+		goto out;
+	}
+
+	sort(refs, nr, sizeof(*refs), chardev_shard_ref_cmp, NULL);
+
+	/* The oldest record is never past the cutoff, it is always picked. */
+	for (i = 0; i < nr; i++) {
+		if (refs[i].timestamp > cutoff ||
+			(i && total + refs[i].len > budget)) {
+			break;
+		}
+
+		run = &runs[refs[i].cpu];
+		run->nr++;
+		run->last = refs[i].timestamp;
+		total += refs[i].len;
+	}
+	nr = i;
+
+	if (total > count) {
+		nr = -EMSGSIZE;
+		goto out;
+	}
+
+	bounce = kvmalloc(total, GFP_KERNEL);
+	if (!bounce) {
+		nr = -ENOMEM;
+		goto out;
+	}
+
+	rc = chardev_shards_take(dev, iocb, runs, bounce, total);
+
+	/* Picks another reader took first are missing from the front of a run. */
+	for (i = 0; i < nr; i++) {
+		run = &runs[refs[i].cpu];
+		if (run->start == run->end) {
+			continue;
+		}
+
+		memcpy(&rec, bounce + run->start, sizeof(rec));
+		if (rec.timestamp > refs[i].timestamp) {
+			continue;
+		}
+
+		len = CHARDEV_RECORD_SIZE(rec.len);
+		if (copy_to_iter(bounce + run->start, len, to) != len) {
+			nr = -EFAULT;
+			goto out;
+		}
+
+		run->start += len;
+		done += len;
+	}
+	nr = rc;
+
+	/*
+	 * Every pick went to another reader or was overwritten, but that
+	 * does not mean the shards hold nothing up to limit.
+	 */
+	if (!done && !rc) {
+		kvfree(bounce);
+		bounce = NULL;
+		memset(runs, 0, nr_cpu_ids * sizeof(*runs));
+		cutoff = limit;
+		total = 0;
+		goto retry;
+	}
+
+out:
+	kvfree(bounce);
+	kvfree(runs);
+	kvfree(refs);
+
+	return done ? done : nr;
+}
+
+/*
+ * Flight recorder mode: writers always succeed, overwriting the oldest
+ * records of their CPU's shard when it is full. A reader takes a snapshot
+ * time on its first read and drains, in timestamp order, every record
+ * written up to that point; end of file marks the end of the snapshot and
+ * the next read starts a new one.
+ */
+static ssize_t chardev_flight_write_iter(struct kiocb *iocb,
+	struct iov_iter *from)
+{
+	struct chardev_file *cf = iocb->ki_filp->private_data;
+	struct chardev_data *dev = cf->dev;
+	size_t count = iov_iter_count(from);
+	struct chardev_shard *sh;
+	ssize_t rc;
+
+	if (!count) {
+		return 0;
+	}
+
+	if (CHARDEV_RECORD_SIZE(count) > dev->shard_size) {
+		return -EMSGSIZE;
+	}
+
+	sh = raw_cpu_ptr(dev->shards);
+
+	rc = chardev_shard_lock(sh, iocb);
+	if (rc < 0) {
+		return rc;
+	}
+
+	rc = chardev_shard_append(dev, sh, from, count, true);
+
+	mutex_unlock(&sh->lock);
+
+	return rc;
+}
+
+static ssize_t chardev_flight_read_iter(struct kiocb *iocb,
+	struct iov_iter *to)
+{
+	struct chardev_file *cf = iocb->ki_filp->private_data;
+	struct chardev_data *dev = cf->dev;
+	ssize_t rc;
+
+	if (!iov_iter_count(to)) {
+		return 0;
+	}
+
+	rc = chardev_file_lock(cf, iocb);
+	if (rc < 0) {
+		return rc;
+	}
+
+	if (!cf->snapshot) {
+		cf->snapshot = ktime_get_ns();
+	}
+
+	rc = chardev_shards_read(dev, iocb, to, cf->snapshot);
+	if (!rc) {
+		cf->snapshot = 0;
+	}
+
+	mutex_unlock(&cf->lock);
+
+	return rc;
+}
+
+/*
+ * Sharded mode uses the same per-CPU shards as a scalable queue: writers
+ * block, or fail with -EAGAIN, when their CPU's shard is full instead of
+ * overwriting, and readers consume records from all shards merged in
+ * timestamp order, sleeping while every shard is empty.
+ */
+static bool chardev_shards_used(struct chardev_data *dev)
+{
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (READ_ONCE(per_cpu_ptr(dev->shards, cpu)->used)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static ssize_t chardev_sharded_write_iter(struct kiocb *iocb,
+	struct iov_iter *from)
+{
+	struct chardev_file *cf = iocb->ki_filp->private_data;
+	struct chardev_data *dev = cf->dev;
+	size_t count = iov_iter_count(from);
+	size_t need = CHARDEV_RECORD_SIZE(count);
+	struct chardev_shard *sh;
+	ssize_t rc;
+
+	if (!count) {
+		return 0;
+	}
+
+	if (need > dev->shard_size) {
+		return -EMSGSIZE;
+	}
+
+	for (;;) {
+		sh = raw_cpu_ptr(dev->shards);
+
+		rc = chardev_shard_lock(sh, iocb);
+		if (rc < 0) {
+			return rc;
+		}
+
+		rc = chardev_shard_append(dev, sh, from, count, false);
+
+		mutex_unlock(&sh->lock);
+
+		if (rc != -ENOSPC) {
+			break;
+		}
+
+		if (chardev_nonblock(iocb)) {
+			return -EAGAIN;
+		}
+
+		if (wait_event_interruptible(dev->write_wq,
+			READ_ONCE(sh->used) <= dev->shard_size - need)) {
+			return -ERESTARTSYS;
+		}
+	}
+
+	if (rc > 0 && wq_has_sleeper(&dev->read_wq)) {
+		wake_up_interruptible_poll(&dev->read_wq, EPOLLIN | EPOLLRDNORM);
+	}
+
+	return rc;
+}
+
+static ssize_t chardev_sharded_read_iter(struct kiocb *iocb,
+	struct iov_iter *to)
+{
+	struct chardev_file *cf = iocb->ki_filp->private_data;
+	struct chardev_data *dev = cf->dev;
+	ssize_t rc;
+
+	if (!iov_iter_count(to)) {
+		return 0;
+	}
+
+	rc = chardev_file_lock(cf, iocb);
+	if (rc < 0) {
+		return rc;
+	}
+
+	for (;;) {
+		rc = chardev_shards_read(dev, iocb, to, U64_MAX);
+		if (rc) {
+			break;
+		}
+
+		if (chardev_nonblock(iocb)) {
+			rc = -EAGAIN;
+			break;
+		}
+
+		if (wait_event_interruptible(dev->read_wq, chardev_shards_used(dev))) {
+			rc = -ERESTARTSYS;
+			break;
+		}
+	}
+
+	mutex_unlock(&cf->lock);
+
+	if (rc > 0 && wq_has_sleeper(&dev->write_wq)) {
+		wake_up_interruptible_poll(&dev->write_wq, EPOLLOUT | EPOLLWRNORM);
+	}
+
+	return rc;
+}
+
+/*
+ * A writer appends to the shard of whatever CPU it runs on at the time, so
+ * the device only counts as writable while every shard has room.
+ */
+static bool chardev_shards_room(struct chardev_data *dev)
+{
+	size_t max = dev->shard_size - CHARDEV_RECORD_SIZE(1);
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (READ_ONCE(per_cpu_ptr(dev->shards, cpu)->used) > max) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static __poll_t chardev_sharded_poll(struct file *filp, poll_table *wait)
+{
+	struct chardev_file *cf = filp->private_data;
+	struct chardev_data *dev = cf->dev;
+	__poll_t mask = 0;
+
+	poll_wait(filp, &dev->read_wq, wait);
+	poll_wait(filp, &dev->write_wq, wait);
+
+	if (chardev_shards_used(dev)) {
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+
+	if (chardev_shards_room(dev)) {
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	}
+
+	return mask;
+}
+
+/*
+ * In spsc mode only one reader and one writer may have the device open, so
+ * the producer owns head and the consumer owns tail. Each side publishes
+ * its index with a release store after touching the data and observes the
+ * other side's with an acquire load, which makes the fast path lockless.
+ */
+static int chardev_spsc_open(struct inode *inode, struct file *filp)
+{
+	struct chardev_data *dev = filp->private_data;
+
+	if ((filp->f_mode & FMODE_READ) &&
+		test_and_set_bit(CHARDEV_SPSC_READER, &dev->flags)) {
+		return -EBUSY;
+	}
+
+	if ((filp->f_mode & FMODE_WRITE) &&
+		test_and_set_bit(CHARDEV_SPSC_WRITER, &dev->flags)) {
+		if (filp->f_mode & FMODE_READ) {
+			clear_bit(CHARDEV_SPSC_READER, &dev->flags);
+		}
+		return -EBUSY;
+	}
+
+	return stream_open(inode, filp);
+}
+
+static int chardev_spsc_release(struct inode *inode, struct file *filp)
+{
+	struct chardev_data *dev = filp->private_data;
+
+	if (filp->f_mode & FMODE_READ) {
+		clear_bit(CHARDEV_SPSC_READER, &dev->flags);
+	}
+
+	if (filp->f_mode & FMODE_WRITE) {
+		clear_bit(CHARDEV_SPSC_WRITER, &dev->flags);
+	}
+
+	return chardev_release(inode, filp);
+}
+
+static size_t chardev_spsc_free(struct chardev_data *dev)
+{
+	return dev->size - 1 -
+		chardev_ring_count(dev, dev->head, smp_load_acquire(&dev->tail));
+}
+
+static size_t chardev_spsc_used(struct chardev_data *dev)
+{
+	return chardev_ring_count(dev, smp_load_acquire(&dev->head), dev->tail);
+}
+
+static ssize_t chardev_spsc_write_iter(struct kiocb *iocb,
+	struct iov_iter *from)
+{
+	struct chardev_data *dev = iocb->ki_filp->private_data;
+	size_t count = iov_iter_count(from);
+	size_t copied;
+	size_t free;
+
+	if (!count) {
+		return 0;
+	}
+
+	while (!(free = chardev_spsc_free(dev))) {
+		if (chardev_nonblock(iocb)) {
+			return -EAGAIN;
+		}
+
+		if (wait_event_interruptible(dev->write_wq, chardev_spsc_free(dev))) {
+			return -ERESTARTSYS;
+		}
+	}
+
+	count = min(count, free);
+	copied = chardev_ring_from_iter(dev, dev->head, from, count);
+	if (!copied) {
+		return -EFAULT;
+	}
+
+	smp_store_release(&dev->head, chardev_ring_advance(dev, dev->head, copied));
+
+	/* Full barrier in wq_has_sleeper() orders the head store before it. */
+	if (wq_has_sleeper(&dev->read_wq)) {
+		wake_up_interruptible_poll(&dev->read_wq, EPOLLIN | EPOLLRDNORM);
+	}
+
+	return copied;
+}
+
+static ssize_t chardev_spsc_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct chardev_data *dev = iocb->ki_filp->private_data;
+	size_t count = iov_iter_count(to);
+	size_t copied;
+	size_t used;
+
+	if (!count) {
+		return 0;
+	}
+
+	while (!(used = chardev_spsc_used(dev))) {
+		if (chardev_nonblock(iocb)) {
+			return -EAGAIN;
+		}
+
+		if (wait_event_interruptible(dev->read_wq, chardev_spsc_used(dev))) {
+			return -ERESTARTSYS;
+		}
+	}
+
+	count = min(count, used);
+	copied = chardev_ring_to_iter(dev, dev->tail, to, count);
+	if (!copied) {
+		return -EFAULT;
+	}
+
+	smp_store_release(&dev->tail, chardev_ring_advance(dev, dev->tail, copied));
+
+	/* Full barrier in wq_has_sleeper() orders the tail store before it. */
+	if (wq_has_sleeper(&dev->write_wq)) {
+		wake_up_interruptible_poll(&dev->write_wq, EPOLLOUT | EPOLLWRNORM);
+	}
+
+	return copied;
+}
+
+/*
+ * In shmring mode the first page of the buffer holds a struct
+ * chardev_ring_header and the rest is the data area. Producer and consumer
+ * move data entirely in userspace through the mapping; the kernel is only
+ * entered to sleep until the ring becomes readable or writable, and to wake
+ * a peer that has flagged itself as sleeping.
+ */
+static struct chardev_ring_header *chardev_shmring_header(
+	struct chardev_data *dev)
+{
+	return page_address(chardev_page(dev, 0));
+}
+
+static u32 chardev_shmring_size(struct chardev_data *dev)
+{
+	return min_t(size_t, rounddown_pow_of_two(dev->size - PAGE_SIZE),
+		1U << 31);
+}
+
+static int chardev_shmring_reset(struct chardev_data *dev)
+{
+	struct chardev_ring_header *hdr;
+
+	if (dev->size < 2 * PAGE_SIZE) {
+		return -EINVAL;
+	}
+
+	hdr = chardev_shmring_header(dev);
+	memset(hdr, 0, PAGE_SIZE);
+	hdr->data_offset = PAGE_SIZE;
+	hdr->data_size = chardev_shmring_size(dev);
+
+	return 0;
+}
+
+static bool chardev_shmring_check(struct chardev_data *dev, u32 event)
+{
+	struct chardev_ring_header *hdr = chardev_shmring_header(dev);
+	u32 head = READ_ONCE(hdr->head);
+	u32 tail = READ_ONCE(hdr->tail);
+
+	if (event == CHARDEV_RING_READABLE) {
+		return head != tail;
+	}
+
+	return head - tail < chardev_shmring_size(dev);
+}
+
+/*
+ * Flag the sleeper before the final check, so that a peer publishing its
+ * index either is seen here or sees the flag and issues a wakeup.
+ */
+static bool chardev_shmring_ready(struct chardev_data *dev, u32 event)
+{
+	struct chardev_ring_header *hdr = chardev_shmring_header(dev);
+
+	if (chardev_shmring_check(dev, event)) {
+		return true;
+	}
+
+	atomic_or(event, (atomic_t *)&hdr->flags);
+	smp_mb__after_atomic();
+
+	return chardev_shmring_check(dev, event);
+}
+
+static long chardev_shmring_wait(struct file *filp, unsigned long events)
+{
+	struct chardev_data *dev = filp->private_data;
+	wait_queue_head_t *wq;
+	u32 event;
+
+	if (events == CHARDEV_RING_READABLE) {
+		wq = &dev->read_wq;
+	} else if (events == CHARDEV_RING_WRITABLE) {
+		wq = &dev->write_wq;
+	} else {
+		return -EINVAL;
+	}
+	event = events;
+
+	if (filp->f_flags & O_NONBLOCK) {
+		return chardev_shmring_check(dev, event) ? 0 : -EAGAIN;
+	}
+
+	return wait_event_interruptible(*wq, chardev_shmring_ready(dev, event));
+}
+
+static long chardev_shmring_wake(struct file *filp, unsigned long events)
+{
+	struct chardev_data *dev = filp->private_data;
+	struct chardev_ring_header *hdr = chardev_shmring_header(dev);
+
+	if (!events ||
+		(events & ~(CHARDEV_RING_READABLE | CHARDEV_RING_WRITABLE))) {
+		return -EINVAL;
+	}
+
+	atomic_andnot(events, (atomic_t *)&hdr->flags);
+
+	if (events & CHARDEV_RING_READABLE) {
+		wake_up_interruptible_poll(&dev->read_wq, EPOLLIN | EPOLLRDNORM);
+	}
+
+	if (events & CHARDEV_RING_WRITABLE) {
+		wake_up_interruptible_poll(&dev->write_wq, EPOLLOUT | EPOLLWRNORM);
+	}
+
+	return 0;
+}
+
+static long chardev_shmring_ioctl(struct file *filp, unsigned int cmd,
+	unsigned long arg)
+{
+	switch (cmd) {
+		case CHARDEV_IOC_RING_WAIT:
+			return chardev_shmring_wait(filp, arg);
+		case CHARDEV_IOC_RING_WAKE:
+			return chardev_shmring_wake(filp, arg);
+		default:
+			return -ENOTTY;
+	}
+}
+
+/*
+ * A poller only flags itself for the directions it asked for, so that the
+ * peer does not pay for wakeups nobody waits for. epoll re-polls without a
+ * queue function while still waiting, so that case flags as well.
+ */
+static bool chardev_shmring_poll_event(struct chardev_data *dev,
+	poll_table *wait, __poll_t events, u32 event)
+{
+	if (!(poll_requested_events(wait) & events)) {
+		return chardev_shmring_check(dev, event);
+	}
+
+	return chardev_shmring_ready(dev, event);
+}
+
+static __poll_t chardev_shmring_poll(struct file *filp, poll_table *wait)
+{
+	struct chardev_data *dev = filp->private_data;
+	__poll_t mask = 0;
+
+	poll_wait(filp, &dev->read_wq, wait);
+	poll_wait(filp, &dev->write_wq, wait);
+
+	if (chardev_shmring_poll_event(dev, wait, EPOLLIN | EPOLLRDNORM,
+		CHARDEV_RING_READABLE)) {
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+
+	if (chardev_shmring_poll_event(dev, wait, EPOLLOUT | EPOLLWRNORM,
+		CHARDEV_RING_WRITABLE)) {
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	}
+
+	return mask;
+}
+
+/*
+ * The snapshot mode publishes the buffer as immutable, reference counted
+ * versions. Readers pin the current version under RCU and copy from it
+ * without taking dev->rwsem, so they never wait for writers. A writer
+ * copies the pages it modifies, shares all others with the previous
+ * version and publishes the result with a single pointer store. dev->pages
+ * always matches the latest version, so the other modes pick up where
+ * this one left off.
+ *
+ * A version's page table is split into reference counted chunks of one
+ * page each, and a new version shares the chunks it does not modify. A
+ * write then costs one reference per chunk, about every 2 MiB of buffer,
+ * plus a copy of each chunk it touches, rather than one per page.
+ */
+#define CHARDEV_SNAP_CHUNK (PAGE_SIZE / sizeof(struct page *) - 1)
+
+struct chardev_snap_chunk {
+	refcount_t ref;
+	struct page *pages[CHARDEV_SNAP_CHUNK];
+};
+
+struct chardev_version {
+	struct chardev_data *dev;
+	refcount_t ref;
+	size_t size;
+	struct rcu_head rcu;
+	struct chardev_snap_chunk *chunks[];
+};
+
+static unsigned long chardev_snap_chunks(size_t size)
+{
+	return DIV_ROUND_UP(DIV_ROUND_UP(size, PAGE_SIZE), CHARDEV_SNAP_CHUNK);
+}
+
+static struct page **chardev_snap_slot(struct chardev_version *v,
+	unsigned long idx)
+{
+	return &v->chunks[idx / CHARDEV_SNAP_CHUNK]->pages[idx % CHARDEV_SNAP_CHUNK];
+}
+
+static void chardev_snap_chunk_put(struct chardev_snap_chunk *c)
+{
+	if (c && refcount_dec_and_test(&c->ref)) {
+		chardev_free_pages(c->pages, 0, CHARDEV_SNAP_CHUNK);
+		kfree(c);
+	}
+}
+
+static void chardev_snap_put(struct chardev_version *v)
+{
+	unsigned long i;
+
+	if (!refcount_dec_and_test(&v->ref)) {
+		return;
+	}
+
+	/* Nobody can take a new reference, only the header may still be seen. */
+	for (i = 0; i < chardev_snap_chunks(v->size); i++) {
+		chardev_snap_chunk_put(v->chunks[i]);
+	}
+	kvfree_rcu(v, rcu);
+}
+
+static struct chardev_version *chardev_snap_alloc(struct chardev_data *dev)
+{
+	unsigned long nr = DIV_ROUND_UP(dev->size, PAGE_SIZE);
+	struct chardev_snap_chunk *c;
+	struct chardev_version *v;
+	unsigned long i;
+
+	v = kvzalloc(struct_size(v, chunks, chardev_snap_chunks(dev->size)),
+		GFP_KERNEL_ACCOUNT);
+	if (!v) {
+		return NULL;
+	}
+
+	v->dev = dev;
+	refcount_set(&v->ref, 1);
+	v->size = dev->size;
+
+	for (i = 0; i < nr; i++) {
+		if (i % CHARDEV_SNAP_CHUNK == 0) {
+			c = kzalloc(sizeof(*c), GFP_KERNEL_ACCOUNT);
+			if (!c) {
+				chardev_snap_put(v);
+				return NULL;
+			}
+			refcount_set(&c->ref, 1);
+			v->chunks[i / CHARDEV_SNAP_CHUNK] = c;
+		}
+
+		c->pages[i % CHARDEV_SNAP_CHUNK] = chardev_page(dev, i);
+		get_page(c->pages[i % CHARDEV_SNAP_CHUNK]);
+	}
+
+	return v;
+}
+
+/* A new version sharing every chunk of old, for a writer to modify. */
+static struct chardev_version *chardev_snap_clone(struct chardev_version *old)
+{
+	unsigned long nr = chardev_snap_chunks(old->size);
+	struct chardev_version *v;
+	unsigned long i;
+
+	v = kvmalloc(struct_size(v, chunks, nr), GFP_KERNEL_ACCOUNT);
+	if (!v) {
+		return NULL;
+	}
+
+	v->dev = old->dev;
+	refcount_set(&v->ref, 1);
+	v->size = old->size;
+
+	for (i = 0; i < nr; i++) {
+		v->chunks[i] = old->chunks[i];
+		refcount_inc(&v->chunks[i]->ref);
+	}
+
+	return v;
+}
+
+/*
+ * Give an unpublished version its own copy of the chunk holding idx. The
+ * version being cloned from still holds a reference to every shared chunk,
+ * so one only referenced once is already private.
+ */
+static int chardev_snap_unshare(struct chardev_version *v, unsigned long idx)
+{
+	struct chardev_snap_chunk **cp = &v->chunks[idx / CHARDEV_SNAP_CHUNK];
+	struct chardev_snap_chunk *c;
+	unsigned long i;
+
+	if (refcount_read(&(*cp)->ref) == 1) {
+		return 0;
+	}
+
+	c = kmemdup(*cp, sizeof(*c), GFP_KERNEL_ACCOUNT);
+	if (!c) {
+		return -ENOMEM;
+	}
+
+	refcount_set(&c->ref, 1);
+	for (i = 0; i < CHARDEV_SNAP_CHUNK; i++) {
+		if (c->pages[i]) {
+			get_page(c->pages[i]);
+		}
+	}
+
+	chardev_snap_chunk_put(*cp);
+	*cp = c;
+
+	return 0;
+}
+
+static size_t chardev_snap_to_iter(struct chardev_version *v, loff_t pos,
+	struct iov_iter *to, size_t count)
+{
+	size_t done = 0;
+
+	while (done < count) {
+		size_t off = offset_in_page(pos);
+		size_t len = min_t(size_t, count - done, PAGE_SIZE - off);
+		size_t n;
+
+		n = copy_page_to_iter(*chardev_snap_slot(v, pos >> PAGE_SHIFT), off,
+			len, to);
+		done += n;
+		pos += n;
+		if (n < len) {
+			break;
+		}
+	}
+
+	return done;
+}
+
+static struct chardev_version *chardev_snap_get(struct chardev_data *dev)
+{
+	struct chardev_version *v;
+
+	rcu_read_lock();
+	do {
+		v = rcu_dereference(dev->version);
+	} while (v && !refcount_inc_not_zero(&v->ref));
+	rcu_read_unlock();
+
+	return v;
+}
+
+/*
+ * Writers are serialised by dev->rwsem, or run before the device is
+ * visible. The replaced version is returned for the caller to put.
+ */
+static struct chardev_version *chardev_snap_publish(struct chardev_data *dev,
+	struct chardev_version *v)
+{
+	return rcu_replace_pointer(dev->version, v, true);
+}
+
+static int chardev_snap_reset(struct chardev_data *dev)
+{
+	struct chardev_version *v;
+
+	v = chardev_snap_alloc(dev);
+	if (!v) {
+		return -ENOMEM;
+	}
+
+	v = chardev_snap_publish(dev, v);
+	if (v) {
+		chardev_snap_put(v);
+	}
+
+	return 0;
+}
+
+static void chardev_snap_leave(struct chardev_data *dev)
+{
+	struct chardev_version *v;
+
+	v = chardev_snap_publish(dev, NULL);
+	if (v) {
+		chardev_snap_put(v);
+	}
+}
+
+static ssize_t chardev_snap_write_iter(struct kiocb *iocb,
+	struct iov_iter *from)
+{
+	struct chardev_data *dev = iocb->ki_filp->private_data;
+	size_t count = iov_iter_count(from);
+	loff_t pos = iocb->ki_pos;
+	struct chardev_version *v;
+	unsigned long first, end, idx;
+	size_t done = 0;
+	int rc;
+
+	if (!count) {
+		return 0;
+	}
+
+	rc = chardev_down_write(dev, iocb);
+	if (rc < 0) {
+		return rc;
+	}
+
+	if (pos >= dev->size) {
+		up_write(&dev->rwsem);
+		return -EFBIG;
+	}
+
+	if (count > dev->size - pos) {
+		count = dev->size - pos;
+	}
+
+	v = chardev_snap_clone(rcu_dereference_protected(dev->version,
+		lockdep_is_held(&dev->rwsem)));
+	if (!v) {
+		up_write(&dev->rwsem);
+		return -ENOMEM;
+	}
+
+	first = pos >> PAGE_SHIFT;
+	for (end = first; done < count; end++) {
+		size_t off = offset_in_page(pos + done);
+		size_t len = min_t(size_t, count - done, PAGE_SIZE - off);
+		struct page **slot;
+		struct page *page;
+		size_t n;
+
+		rc = chardev_snap_unshare(v, end);
+		if (rc < 0) {
+			break;
+		}
+
+		page = chardev_alloc_page(dev, GFP_KERNEL_ACCOUNT);
+		if (!page) {
+			rc = -ENOMEM;
+			break;
+		}
+
+		slot = chardev_snap_slot(v, end);
+		copy_page(page_address(page), page_address(*slot));
+		n = copy_page_from_iter(page, off, len, from);
+		swap(*slot, page);
+		put_page(page);
+
+		done += n;
+		if (n < len) {
+			end++;
+			rc = -EFAULT;
+			break;
+		}
+	}
+
+	if (!done) {
+		up_write(&dev->rwsem);
+		chardev_snap_put(v);
+		return rc;
+	}
+
+	/* Replacing present entries never allocates, so this cannot fail. */
+	for (idx = first; idx < end; idx++) {
+		struct page *page = *chardev_snap_slot(v, idx);
+
+		get_page(page);
+		put_page(xa_store(&dev->pages, idx, page, GFP_KERNEL));
+	}
+
+	iocb->ki_pos += done;
+	chardev_mark_dirty(dev, pos, done);
+	v = chardev_snap_publish(dev, v);
+
+	up_write(&dev->rwsem);
+
+	chardev_snap_put(v);
+
+	return done;
+}
+
+static ssize_t chardev_snap_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct chardev_data *dev = iocb->ki_filp->private_data;
+	size_t count = iov_iter_count(to);
+	loff_t pos = iocb->ki_pos;
+	struct chardev_version *v;
+	size_t copied;
+
+	v = chardev_snap_get(dev);
+	if (!v) {
+		return -ENXIO;
+	}
+
+	if (pos >= v->size) {
+		chardev_snap_put(v);
+		return 0;
+	}
+
+	if (count > v->size - pos) {
+		count = v->size - pos;
+	}
+
+	copied = chardev_snap_to_iter(v, pos, to, count);
+	chardev_snap_put(v);
+	if (!copied && count) {
+		return -EFAULT;
+	}
+
+	iocb->ki_pos += copied;
+
+	return copied;
+}
+
+/*
+ * A mapping pins the version that was current at mmap time and is never
+ * updated by later writes. It is read-only, as the pages are shared.
+ */
+static void chardev_snap_vma_open(struct vm_area_struct *vma)
+{
+	struct chardev_version *v = vma->vm_private_data;
+
+	refcount_inc(&v->ref);
+	atomic_inc(&v->dev->mmap_count);
+}
+
+static void chardev_snap_vma_close(struct vm_area_struct *vma)
+{
+	struct chardev_version *v = vma->vm_private_data;
+
+	atomic_dec(&v->dev->mmap_count);
+	chardev_snap_put(v);
+}
+
+static vm_fault_t chardev_snap_vma_fault(struct vm_fault *vmf)
+{
+	struct chardev_version *v = vmf->vma->vm_private_data;
+	struct page *page;
+
+	if (vmf->pgoff >= DIV_ROUND_UP(v->size, PAGE_SIZE)) {
+		return VM_FAULT_SIGBUS;
+	}
+
+	page = *chardev_snap_slot(v, vmf->pgoff);
+	get_page(page);
+	vmf->page = page;
+
+	return 0;
+}
+
+static const struct vm_operations_struct chardev_snap_vm_ops = {
+	.open = chardev_snap_vma_open,
+	.close = chardev_snap_vma_close,
+	.fault = chardev_snap_vma_fault,
+};
+
+static int chardev_snap_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct chardev_data *dev = filp->private_data;
+	struct chardev_version *v;
+	unsigned long nr;
+
+	if (vma->vm_flags & VM_WRITE) {
+		return -EPERM;
+	}
+
+	v = chardev_snap_get(dev);
+	if (!v) {
+		return -ENXIO;
+	}
+
+	nr = DIV_ROUND_UP(v->size, PAGE_SIZE);
+	if (vma->vm_pgoff >= nr || vma_pages(vma) > nr - vma->vm_pgoff) {
+		chardev_snap_put(v);
+		return -EINVAL;
+	}
+
+	vma->vm_ops = &chardev_snap_vm_ops;
+	vma->vm_private_data = v;
+	vm_flags_mod(vma, VM_DONTEXPAND, VM_MAYWRITE);
+	atomic_inc(&dev->mmap_count);
+
+	return 0;
+}
+
+static const struct file_operations chardev_fileops = {
+	.owner = THIS_MODULE,
+	.write_iter = chardev_write_iter,
+	.read_iter = chardev_read_iter,
+	.splice_write = iter_file_splice_write,
+	.splice_read = chardev_splice_read,
+	.llseek = chardev_lseek,
+	.unlocked_ioctl = chardev_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.mmap = chardev_mmap,
+	.open = chardev_open,
+	.release = chardev_release,
+};
+
+static const struct file_operations chardev_fifo_fileops = {
+	.owner = THIS_MODULE,
+	.write_iter = chardev_fifo_write_iter,
+	.read_iter = chardev_fifo_read_iter,
+	.splice_write = iter_file_splice_write,
+	.splice_read = copy_splice_read,
+	.poll = chardev_fifo_poll,
+	.release = chardev_release,
+};
+
+static const struct file_operations chardev_spsc_fileops = {
+	.owner = THIS_MODULE,
+	.write_iter = chardev_spsc_write_iter,
+	.read_iter = chardev_spsc_read_iter,
+	.splice_write = iter_file_splice_write,
+	.splice_read = copy_splice_read,
+	.poll = chardev_fifo_poll,
+	.release = chardev_spsc_release,
+};
+
+static const struct file_operations chardev_shmring_fileops = {
+	.owner = THIS_MODULE,
+	.poll = chardev_shmring_poll,
+	.unlocked_ioctl = chardev_shmring_ioctl,
+	.compat_ioctl = chardev_shmring_ioctl,
+	.mmap = chardev_mmap,
+	.release = chardev_release,
+};
+
+static const struct file_operations chardev_record_fileops = {
+	.owner = THIS_MODULE,
+	.write_iter = chardev_record_write_iter,
+	.read_iter = chardev_record_read_iter,
+	.poll = chardev_record_poll,
+	.release = chardev_release,
+};
+
+static const struct file_operations chardev_bcast_fileops = {
+	.owner = THIS_MODULE,
+	.write_iter = chardev_bcast_write_iter,
+	.read_iter = chardev_bcast_read_iter,
+	.splice_write = iter_file_splice_write,
+	.splice_read = copy_splice_read,
+	.poll = chardev_bcast_poll,
+	.release = chardev_file_release,
+};
+
+static const struct file_operations chardev_flight_fileops = {
+	.owner = THIS_MODULE,
+	.write_iter = chardev_flight_write_iter,
+	.read_iter = chardev_flight_read_iter,
+	.splice_write = iter_file_splice_write,
+	.splice_read = copy_splice_read,
+	.release = chardev_file_release,
+};
+
+static const struct file_operations chardev_sharded_fileops = {
+	.owner = THIS_MODULE,
+	.write_iter = chardev_sharded_write_iter,
+	.read_iter = chardev_sharded_read_iter,
+	.splice_write = iter_file_splice_write,
+	.splice_read = copy_splice_read,
+	.poll = chardev_sharded_poll,
+	.release = chardev_file_release,
+};
+
+static const struct file_operations chardev_snap_fileops = {
+	.owner = THIS_MODULE,
+	.write_iter = chardev_snap_write_iter,
+	.read_iter = chardev_snap_read_iter,
+	.splice_write = iter_file_splice_write,
+	.splice_read = copy_splice_read,
+	.llseek = chardev_lseek,
+	.mmap = chardev_snap_mmap,
+	.release = chardev_release,
+};
+
+static const struct chardev_mode chardev_modes[] = {
+	{
+		.name = "buffer",
+		.fops = &chardev_fileops,
+	},
+	{
+		.name = "fifo",
+		.fops = &chardev_fifo_fileops,
+		.open = chardev_stream_open,
+		.reset = chardev_fifo_reset,
+	},
+	{
+		.name = "spsc",
+		.fops = &chardev_spsc_fileops,
+		.open = chardev_spsc_open,
+		.reset = chardev_fifo_reset,
+	},
+	{
+		.name = "shmring",
+		.fops = &chardev_shmring_fileops,
+		.open = chardev_stream_open,
+		.reset = chardev_shmring_reset,
+	},
+	{
+		.name = "record",
+		.fops = &chardev_record_fileops,
+		.open = chardev_stream_open,
+		.reset = chardev_record_reset,
+	},
+	{
+		.name = "broadcast",
+		.fops = &chardev_bcast_fileops,
+		.open = chardev_bcast_open,
+		.reset = chardev_bcast_reset,
+	},
+	{
+		.name = "flight",
+		.fops = &chardev_flight_fileops,
+		.open = chardev_file_open,
+		.reset = chardev_shards_reset,
+		.leave = chardev_shards_leave,
+	},
+	{
+		.name = "sharded",
+		.fops = &chardev_sharded_fileops,
+		.open = chardev_file_open,
+		.reset = chardev_shards_reset,
+		.leave = chardev_shards_leave,
+	},
+	{
+		.name = "snapshot",
+		.fops = &chardev_snap_fileops,
+		.reset = chardev_snap_reset,
+		.leave = chardev_snap_leave,
+	},
+};
+
+static const struct chardev_mode *chardev_find_mode(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(chardev_modes); i++) {
+		if (sysfs_streq(name, chardev_modes[i].name)) {
+			return &chardev_modes[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Modes that share state, such as the per-CPU shards, share their leave
+ * hook, which is then skipped so the new mode keeps what reset set up.
+ */
+static int chardev_set_mode(struct chardev_data *dev,
+	const struct chardev_mode *mode)
+{
+	const struct chardev_mode *old = dev->mode;
+	int rc;
 
-#define CHARDEV_BUFSIZE 16
+	if (mode->reset) {
+		rc = chardev_reset(dev, mode);
+		if (rc < 0) {
+			return rc;
+		}
+	}
 
-MODULE_AUTHOR("Michal Miladowski <michal.miladowski@gmail.com>");
-MODULE_DESCRIPTION("Character Device Driver Template");
-MODULE_LICENSE("GPL");
+	if (old && old->leave && old->leave != mode->leave) {
+		old->leave(dev);
+	}
 
-struct chardev_data {
-	struct cdev cdev;
-	u8 *buffer;
-	struct mutex mutex;
-};
+	/* Only buffer and snapshot writes are tracked, the old mode's are not. */
+	if (old) {
+		chardev_mark_all(dev);
+	}
 
-static dev_t chardev_id;
-static struct class *chardev_class;
-static struct chardev_data chardev[NUM_OF_DEVS];
+	WRITE_ONCE(dev->mode, mode);
+
+	return 0;
+}
 
-static ssize_t chardev_write(struct file *filp, const char __user *buf,
-	size_t count, loff_t *f_pos)
+static ssize_t buffer_size_show(struct device *device,
+	struct device_attribute *attr, char *buf)
 {
-	struct chardev_data *dev = filp->private_data;
+	struct chardev_data *dev = dev_get_drvdata(device);
+
+	return sysfs_emit(buf, "%zu\n", READ_ONCE(dev->size));
+}
 
-	mutex_lock(&dev->mutex);
+static ssize_t buffer_size_store(struct device *device,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct chardev_data *dev = dev_get_drvdata(device);
+	unsigned long long size;
+	int rc;
 
-	if (*f_pos + count > CHARDEV_BUFSIZE) {
-		count = CHARDEV_BUFSIZE - *f_pos;
+	rc = kstrtoull(buf, 0, &size);
+	if (rc < 0) {
+		return rc;
 	}
 
-	if (!count) {
-		mutex_unlock(&dev->mutex);
-		return -EFBIG;
+	if (!size || size > CHARDEV_MAX_BUFSIZE) {
+		return -EINVAL;
 	}
 
-	if (copy_from_user(dev->buffer + *f_pos, buf, count) != 0) {
-		mutex_unlock(&dev->mutex);
-		return -EFAULT;
+	down_write(&dev->rwsem);
+	mutex_lock(&dev->map_lock);
+	if (atomic_read(&dev->mmap_count) ||
+		(!chardev_is_buffer_mode(dev) && atomic_read(&dev->open_count))) {
+		rc = -EBUSY;
+	} else {
+		rc = chardev_resize(dev, size);
+		if (!rc && !chardev_is_buffer_mode(dev)) {
+			rc = chardev_reset(dev, dev->mode);
+		}
+	}
+	mutex_unlock(&dev->map_lock);
+	up_write(&dev->rwsem);
+
+	/* Waiters on words that no longer exist fail with -EINVAL. */
+	if (!rc) {
+		chardev_wake_range(dev, size, CHARDEV_MAX_BUFSIZE);
 	}
 
-	*f_pos += count;
+	return rc < 0 ? rc : count;
+}
+static DEVICE_ATTR_RW(buffer_size);
+
+static ssize_t mode_show(struct device *device,
+	struct device_attribute *attr, char *buf)
+{
+	struct chardev_data *dev = dev_get_drvdata(device);
+	const struct chardev_mode *cur = READ_ONCE(dev->mode);
+	ssize_t len = 0;
+	int i;
 
-	mutex_unlock(&dev->mutex);
+	for (i = 0; i < ARRAY_SIZE(chardev_modes); i++) {
+		if (&chardev_modes[i] == cur) {
+			len += sysfs_emit_at(buf, len, "[%s] ", chardev_modes[i].name);
+		} else {
+			len += sysfs_emit_at(buf, len, "%s ", chardev_modes[i].name);
+		}
+	}
+	buf[len - 1] = '\n';
 
-	return count;
+	return len;
 }
 
-static ssize_t chardev_read(struct file *filp, char __user *buf,
-	size_t count, loff_t *f_pos)
+static ssize_t mode_store(struct device *device,
+	struct device_attribute *attr, const char *buf, size_t count)
 {
-	struct chardev_data *dev = filp->private_data;
+	struct chardev_data *dev = dev_get_drvdata(device);
+	const struct chardev_mode *mode;
+	int rc;
 
-	mutex_lock(&dev->mutex);
+	mode = chardev_find_mode(buf);
+	if (!mode) {
+		return -EINVAL;
+	}
 
-	if (*f_pos + count > CHARDEV_BUFSIZE) {
-		count = CHARDEV_BUFSIZE - *f_pos;
+	down_write(&dev->rwsem);
+	if (atomic_read(&dev->open_count) || atomic_read(&dev->mmap_count)) {
+		rc = -EBUSY;
+	} else {
+		rc = chardev_set_mode(dev, mode);
 	}
+	up_write(&dev->rwsem);
 
-	if (copy_to_user(buf, dev->buffer + *f_pos, count) != 0) {
-		mutex_unlock(&dev->mutex);
-		return -EFAULT;
+	return rc < 0 ? rc : count;
+}
+static DEVICE_ATTR_RW(mode);
+
+static ssize_t reclaim_show(struct device *device,
+	struct device_attribute *attr, char *buf)
+{
+	struct chardev_data *dev = dev_get_drvdata(device);
+
+	return sysfs_emit(buf, "%d\n", READ_ONCE(dev->reclaim));
+}
+
+static ssize_t reclaim_store(struct device *device,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct chardev_data *dev = dev_get_drvdata(device);
+	bool reclaim;
+	int rc;
+
+	rc = kstrtobool(buf, &reclaim);
+	if (rc < 0) {
+		return rc;
+	}
+
+	WRITE_ONCE(dev->reclaim, reclaim);
+
+	return count;
+}
+static DEVICE_ATTR_RW(reclaim);
+
+static ssize_t numa_node_show(struct device *device,
+	struct device_attribute *attr, char *buf)
+{
+	struct chardev_data *dev = dev_get_drvdata(device);
+
+	return sysfs_emit(buf, "%d\n", READ_ONCE(dev->node));
+}
+
+static ssize_t numa_node_store(struct device *device,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct chardev_data *dev = dev_get_drvdata(device);
+	int node;
+	int rc;
+
+	rc = kstrtoint(buf, 0, &node);
+	if (rc < 0) {
+		return rc;
 	}
 
-	*f_pos += count;
+	if (node != NUMA_NO_NODE &&
+		(node < 0 || node >= nr_node_ids || !node_online(node))) {
+		return -EINVAL;
+	}
 
-	mutex_unlock(&dev->mutex);
+	WRITE_ONCE(dev->node, node);
 
 	return count;
 }
+static DEVICE_ATTR_RW(numa_node);
 
-static loff_t chardev_lseek(struct file *filp, loff_t off, int whence)
+static ssize_t replicas_show(struct device *device,
+	struct device_attribute *attr, char *buf)
 {
-	struct chardev_data *dev = filp->private_data;
-	loff_t tmp;
+	struct chardev_data *dev = dev_get_drvdata(device);
 
-	mutex_lock(&dev->mutex);
+	return sysfs_emit(buf, "%d\n", READ_ONCE(dev->replicas) != NULL);
+}
 
-	switch (whence) {
-		case SEEK_SET:
-			tmp = off;
-			break;
-		case SEEK_CUR:
-			tmp = filp->f_pos + off;
+static ssize_t replicas_store(struct device *device,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct chardev_data *dev = dev_get_drvdata(device);
+	bool replicas;
+	int rc = 0;
+
+	rc = kstrtobool(buf, &replicas);
+	if (rc < 0) {
+		return rc;
+	}
+
+	down_write(&dev->rwsem);
+	if (replicas) {
+		rc = chardev_replicas_enable(dev);
+	} else {
+		chardev_replicas_disable(dev);
+	}
+	up_write(&dev->rwsem);
+
+	return rc < 0 ? rc : count;
+}
+static DEVICE_ATTR_RW(replicas);
+
+static ssize_t usage_show(struct device *device,
+	struct device_attribute *attr, char *buf)
+{
+	struct chardev_data *dev = dev_get_drvdata(device);
+
+	return sysfs_emit(buf, "%lu\n",
+		atomic_long_read(&dev->nr_pages) << PAGE_SHIFT);
+}
+static DEVICE_ATTR_RO(usage);
+
+static ssize_t replica_usage_show(struct device *device,
+	struct device_attribute *attr, char *buf)
+{
+	struct chardev_data *dev = dev_get_drvdata(device);
+
+	return sysfs_emit(buf, "%lu\n",
+		atomic_long_read(&dev->nr_replica_pages) << PAGE_SHIFT);
+}
+static DEVICE_ATTR_RO(replica_usage);
+
+static struct attribute *chardev_attrs[] = {
+	&dev_attr_buffer_size.attr,
+	&dev_attr_mode.attr,
+	&dev_attr_reclaim.attr,
+	&dev_attr_usage.attr,
+	&dev_attr_numa_node.attr,
+	&dev_attr_replicas.attr,
+	&dev_attr_replica_usage.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(chardev);
+
+/*
+ * Under memory pressure, read replicas are dropped first, as they are made
+ * again on the next read. Then pages of devices that opted in with the
+ * reclaim attribute are returned to the system if they only hold zeroes,
+ * which read back the same as a hole. Only unmapped devices in buffer mode
+ * are scanned, as the other modes address the whole buffer directly. Each
+ * device keeps a cursor so that successive scans make progress, and is
+ * not counted again once a full pass found nothing written since.
+ *
+ * The shrinker is not memcg aware. Pages are charged to the cgroup of the
+ * task that first touched them, but a memcg aware shrinker is only called
+ * for cgroups whose shrinker bit is set, which modules can only arrange
+ * through a list_lru. Threading every page through one would cost the
+ * page->lru of pages that may be mapped into user space. So only global
+ * reclaim frees these pages. A cgroup that hits its own limit is not
+ * helped by them and can be OOM killed while they are still reclaimable.
+ * Such tenants should leave room in their limit for their device usage.
+ */
+static bool chardev_reclaimable(struct chardev_data *dev)
+{
+	return READ_ONCE(dev->reclaim) && chardev_is_buffer_mode(dev) &&
+		!atomic_read(&dev->mmap_count) &&
+		READ_ONCE(dev->reclaim_gen) != atomic64_read(&dev->write_gen);
+}
+
+static unsigned long chardev_shrink_count(struct shrinker *shrinker,
+	struct shrink_control *sc)
+{
+	struct chardev_data *dev;
+	unsigned long count = 0;
+	unsigned long minor;
+
+	if (!mutex_trylock(&chardev_devs_lock)) {
+		return 0;
+	}
+
+	xa_for_each(&chardev_devs, minor, dev) {
+		count += atomic_long_read(&dev->nr_replica_pages);
+		if (chardev_reclaimable(dev)) {
+			count += atomic_long_read(&dev->nr_pages);
+		}
+	}
+
+	mutex_unlock(&chardev_devs_lock);
+
+	return count ? count : SHRINK_EMPTY;
+}
+
+/* Replicas are only ever dropped under the exclusive lock, see above. */
+static unsigned long chardev_shrink_replicas(struct chardev_data *dev,
+	unsigned long nr_to_scan, unsigned long *scanned)
+{
+	unsigned long freed = 0;
+	struct page *page;
+	unsigned long idx;
+	int nid;
+
+	if (!dev->replicas) {
+		return 0;
+	}
+
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		xa_for_each(&dev->replicas[nid], idx, page) {
+			if (*scanned >= nr_to_scan) {
+				return freed;
+			}
+
+			(*scanned)++;
+			xa_erase(&dev->replicas[nid], idx);
+			put_page(page);
+			atomic_long_dec(&dev->nr_replica_pages);
+			freed++;
+		}
+	}
+
+	clear_bit(CHARDEV_REPLICAS_STALE, &dev->flags);
+
+	return freed;
+}
+
+static unsigned long chardev_shrink_zeroes(struct chardev_data *dev,
+	unsigned long nr_to_scan, unsigned long *scanned)
+{
+	unsigned long freed = 0;
+	struct page *page;
+	unsigned long idx;
+	u64 gen;
+
+	if (*scanned >= nr_to_scan || !mutex_trylock(&dev->map_lock)) {
+		return 0;
+	}
+
+	if (!chardev_reclaimable(dev)) {
+		mutex_unlock(&dev->map_lock);
+		return 0;
+	}
+
+	if (!dev->reclaim_pos) {
+		dev->reclaim_pass_gen = atomic64_read(&dev->write_gen);
+	}
+
+	xa_for_each_start(&dev->pages, idx, page, dev->reclaim_pos) {
+		if (*scanned >= nr_to_scan) {
 			break;
-		case SEEK_END:
-			tmp = CHARDEV_BUFSIZE + off;
+		}
+
+		(*scanned)++;
+		if (memchr_inv(page_address(page), 0, PAGE_SIZE)) {
+			continue;
+		}
+
+		/* The hole cannot carry the stamp, report the whole buffer instead. */
+		chardev_raise_all_gen(dev, page_private(page));
+		xa_erase(&dev->pages, idx);
+		put_page(page);
+		atomic_long_dec(&dev->nr_pages);
+		chardev_replicas_drop(dev, idx, idx);
+		freed++;
+	}
+
+	/* Removing pages invalidates shadows, but needs no further pass. */
+	if (freed) {
+		gen = atomic64_inc_return(&dev->write_gen);
+		if (dev->reclaim_pass_gen == gen - 1) {
+			dev->reclaim_pass_gen = gen;
+		}
+	}
+
+	if (page) {
+		dev->reclaim_pos = idx;
+	} else {
+		dev->reclaim_pos = 0;
+		WRITE_ONCE(dev->reclaim_gen, dev->reclaim_pass_gen);
+	}
+
+	mutex_unlock(&dev->map_lock);
+
+	return freed;
+}
+
+static unsigned long chardev_shrink_dev(struct chardev_data *dev,
+	unsigned long nr_to_scan, unsigned long *scanned)
+{
+	unsigned long freed;
+
+	if (!down_write_trylock(&dev->rwsem)) {
+		return 0;
+	}
+
+	freed = chardev_shrink_replicas(dev, nr_to_scan, scanned);
+	freed += chardev_shrink_zeroes(dev, nr_to_scan, scanned);
+
+	up_write(&dev->rwsem);
+
+	return freed;
+}
+
+static unsigned long chardev_shrink_scan(struct shrinker *shrinker,
+	struct shrink_control *sc)
+{
+	struct chardev_data *dev;
+	unsigned long scanned = 0;
+	unsigned long freed = 0;
+	unsigned long minor;
+
+	if (!mutex_trylock(&chardev_devs_lock)) {
+		return SHRINK_STOP;
+	}
+
+	xa_for_each(&chardev_devs, minor, dev) {
+		if (scanned >= sc->nr_to_scan) {
 			break;
-		default:
-			mutex_unlock(&dev->mutex);
-			return -EINVAL;
+		}
+
+		if (atomic_long_read(&dev->nr_replica_pages) ||
+			chardev_reclaimable(dev)) {
+			freed += chardev_shrink_dev(dev, sc->nr_to_scan, &scanned);
+		}
 	}
 
-	if (tmp > CHARDEV_BUFSIZE || tmp < 0) {
-		mutex_unlock(&dev->mutex);
-		return -EINVAL;
+	mutex_unlock(&chardev_devs_lock);
+
+	/*
+	 * A device whose lock is held, possibly by the very task that is
+	 * reclaiming, cannot be scanned. Reporting no progress as zero pages
+	 * scanned would have the caller retry forever.
+	 */
+	if (!scanned) {
+		return SHRINK_STOP;
 	}
 
-	filp->f_pos = tmp;
+	sc->nr_scanned = scanned;
+
+	return freed;
+}
 
-	mutex_unlock(&dev->mutex);
+static void chardev_device_release(struct device *device)
+{
+	struct chardev_data *dev = container_of(device, struct chardev_data,
+		device);
 
-	return tmp;
+	chardev_free_buffer(dev);
+	kfree(dev);
 }
 
-static int chardev_open(struct inode *inode, struct file *filp)
+/*
+ * Open files hold the cdev, which holds the device, so a removed device
+ * stays usable by its existing users until the last one goes away.
+ */
+static int chardev_add(unsigned int minor)
 {
 	struct chardev_data *dev;
+	int rc;
 
-	dev = container_of(inode->i_cdev, struct chardev_data, cdev);
+	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+	if (!dev) {
+		return -ENOMEM;
+	}
 
-	filp->private_data = dev;
+	xa_init_flags(&dev->pages, XA_FLAGS_ACCOUNT);
+	dev->node = NUMA_NO_NODE;
+	init_rwsem(&dev->rwsem);
+	mutex_init(&dev->map_lock);
+	spin_lock_init(&dev->gen_lock);
+	init_waitqueue_head(&dev->read_wq);
+	init_waitqueue_head(&dev->write_wq);
+
+	device_initialize(&dev->device);
+	dev->device.class = chardev_class;
+	dev->device.devt = MKDEV(MAJOR(chardev_id), minor);
+	dev->device.groups = chardev_groups;
+	dev->device.release = chardev_device_release;
+	dev_set_drvdata(&dev->device, dev);
+
+	rc = dev_set_name(&dev->device, "%s%u", DRV_NAME, minor);
+	if (rc < 0) {
+		goto err_put;
+	}
+
+	rc = chardev_resize(dev, buffer_size);
+	if (rc < 0) {
+		pr_err("%s: failed to allocate device buffer\n", DRV_NAME);
+		goto err_put;
+	}
+
+	rc = chardev_set_mode(dev, chardev_find_mode(default_mode));
+	if (rc < 0) {
+		pr_err("%s: failed to set device mode\n", DRV_NAME);
+		goto err_put;
+	}
+
+	mutex_lock(&chardev_devs_lock);
+
+	rc = xa_insert(&chardev_devs, minor, dev, GFP_KERNEL);
+	if (rc < 0) {
+		mutex_unlock(&chardev_devs_lock);
+		rc = rc == -EBUSY ? -EEXIST : rc;
+		goto err_put;
+	}
+
+	cdev_init(&dev->cdev, &chardev_fileops);
+	dev->cdev.owner = THIS_MODULE;
+	rc = cdev_device_add(&dev->cdev, &dev->device);
+	if (rc < 0) {
+		pr_err("%s: failed to add device\n", DRV_NAME);
+		xa_erase(&chardev_devs, minor);
+		mutex_unlock(&chardev_devs_lock);
+		goto err_put;
+	}
+
+	mutex_unlock(&chardev_devs_lock);
 
 	return 0;
+
+err_put:
+	put_device(&dev->device);
+	return rc;
 }
 
-static int chardev_release(struct inode *inode, struct file *filp)
+static int chardev_remove(unsigned int minor)
 {
+	struct chardev_data *dev;
+
+	mutex_lock(&chardev_devs_lock);
+	dev = xa_erase(&chardev_devs, minor);
+	if (dev) {
+		cdev_device_del(&dev->cdev, &dev->device);
+	}
+	mutex_unlock(&chardev_devs_lock);
+
+	if (!dev) {
+		return -ENODEV;
+	}
+
+	put_device(&dev->device);
+
 	return 0;
 }
 
-static const struct file_operations chardev_fileops = {
-	.owner = THIS_MODULE,
-	.write = chardev_write,
-	.read = chardev_read,
-	.llseek = chardev_lseek,
-	.open = chardev_open,
-	.release = chardev_release,
-};
+static void chardev_remove_all(void)
+{
+	struct chardev_data *dev;
+	unsigned long minor;
+
+	xa_for_each(&chardev_devs, minor, dev) {
+		chardev_remove(minor);
+	}
+}
+
+static ssize_t add_store(const struct class *class,
+	const struct class_attribute *attr, const char *buf, size_t count)
+{
+	unsigned int minor;
+	int rc;
+
+	rc = kstrtouint(buf, 0, &minor);
+	if (rc < 0) {
+		return rc;
+	}
+
+	if (minor >= CHARDEV_MAX_DEVS) {
+		return -EINVAL;
+	}
+
+	rc = chardev_add(minor);
+
+	return rc < 0 ? rc : count;
+}
+static CLASS_ATTR_WO(add);
+
+static ssize_t remove_store(const struct class *class,
+	const struct class_attribute *attr, const char *buf, size_t count)
+{
+	unsigned int minor;
+	int rc;
+
+	rc = kstrtouint(buf, 0, &minor);
+	if (rc < 0) {
+		return rc;
+	}
+
+	rc = chardev_remove(minor);
+
+	return rc < 0 ? rc : count;
+}
+static CLASS_ATTR_WO(remove);
 
 static int __init chardev_init(void)
 {
 	int i;
 	int rc;
-	dev_t dev_id;
-	struct device *dev;
 
-	rc = alloc_chrdev_region(&chardev_id, 0, NUM_OF_DEVS, DRV_NAME);
+	if (!buffer_size || buffer_size > CHARDEV_MAX_BUFSIZE) {
+		pr_err("%s: invalid buffer size %lu\n", DRV_NAME, buffer_size);
+		return -EINVAL;
+	}
+
+	if (!chardev_find_mode(default_mode)) {
+		pr_err("%s: invalid mode %s\n", DRV_NAME, default_mode);
+		return -EINVAL;
+	}
+
+	if (num_devs > CHARDEV_MAX_DEVS) {
+		pr_err("%s: invalid number of devices %u\n", DRV_NAME, num_devs);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(chardev_wait_table); i++) {
+		init_waitqueue_head(&chardev_wait_table[i]);
+	}
+
+	chardev_shrinker = shrinker_alloc(0, DRV_NAME);
+	if (!chardev_shrinker) {
+		pr_err("%s: failed to allocate shrinker\n", DRV_NAME);
+		return -ENOMEM;
+	}
+	chardev_shrinker->count_objects = chardev_shrink_count;
+	chardev_shrinker->scan_objects = chardev_shrink_scan;
+
+	rc = alloc_chrdev_region(&chardev_id, 0, CHARDEV_MAX_DEVS, DRV_NAME);
 	if (rc < 0) {
 		pr_err("%s: failed to allocate char dev region\n", DRV_NAME);
 		goto err_chrdev;
@@ -157,68 +4349,52 @@ static int __init chardev_init(void)
 		goto err_class_create;
 	}
 
-	for (i = 0; i < NUM_OF_DEVS; i++) {
-		dev_id = MKDEV(MAJOR(chardev_id), MINOR(chardev_id) + i);
-		cdev_init(&chardev[i].cdev, &chardev_fileops);
-		chardev[i].cdev.owner = THIS_MODULE;
-		rc = cdev_add(&chardev[i].cdev, dev_id, 1);
-		if (rc < 0) {
-			pr_err("%s: failed to add cdev\n", DRV_NAME);
-			goto err_cdev_add;
-		}
+	rc = class_create_file(chardev_class, &class_attr_add);
+	if (rc < 0) {
+		pr_err("%s: failed to create class attribute\n", DRV_NAME);
+		goto err_attr_add;
+	}
 
-		dev = device_create(chardev_class, NULL, dev_id, NULL,
-							"%s%d", DRV_NAME, i);
-		if (IS_ERR(dev)) {
-			pr_err("%s: failed to create device\n", DRV_NAME);
-			cdev_del(&chardev[i].cdev);
-			rc = PTR_ERR(dev);
-			goto err_device_create;
-		}
+	rc = class_create_file(chardev_class, &class_attr_remove);
+	if (rc < 0) {
+		pr_err("%s: failed to create class attribute\n", DRV_NAME);
+		goto err_attr_remove;
+	}
 
-		chardev[i].buffer = kzalloc(CHARDEV_BUFSIZE, GFP_KERNEL);
-		if (!chardev[i].buffer) {
-			pr_err("%s: failed to allocate device buffer\n", DRV_NAME);
-			device_destroy(chardev_class, dev_id);
-			cdev_del(&chardev[i].cdev);
-			rc = -ENOMEM;
-			goto err_alloc;
+	for (i = 0; i < num_devs; i++) {
+		rc = chardev_add(i);
+		if (rc < 0) {
+			goto err_add;
 		}
-
-		mutex_init(&chardev[i].mutex);
 	}
 
+	shrinker_register(chardev_shrinker);
+
 	return 0;
 
-err_alloc:
-err_device_create:
-err_cdev_add:
-	for (i--; i >= 0; i--) {
-		dev_id = MKDEV(MAJOR(chardev_id), MINOR(chardev_id) + i);
-		kfree(chardev[i].buffer);
-		device_destroy(chardev_class, dev_id);
-		cdev_del(&chardev[i].cdev);
-	}
+err_add:
+	chardev_remove_all();
+	class_remove_file(chardev_class, &class_attr_remove);
+err_attr_remove:
+	class_remove_file(chardev_class, &class_attr_add);
+err_attr_add:
 	class_destroy(chardev_class);
 err_class_create:
-	unregister_chrdev_region(chardev_id, NUM_OF_DEVS);
+	unregister_chrdev_region(chardev_id, CHARDEV_MAX_DEVS);
 err_chrdev:
+	shrinker_free(chardev_shrinker);
 	return rc;
 }
 
 static void __exit chardev_exit(void)
 {
-	int i;
-	dev_t dev_id;
-
-	for (i = 0; i < NUM_OF_DEVS; i++) {
-		dev_id = MKDEV(MAJOR(chardev_id), MINOR(chardev_id) + i);
-		kfree(chardev[i].buffer);
-		device_destroy(chardev_class, dev_id);
-		cdev_del(&chardev[i].cdev);
- 	}
+	shrinker_free(chardev_shrinker);
+	class_remove_file(chardev_class, &class_attr_remove);
+	class_remove_file(chardev_class, &class_attr_add);
+	chardev_remove_all();
 	class_destroy(chardev_class);
-	unregister_chrdev_region(chardev_id, NUM_OF_DEVS);
+	unregister_chrdev_region(chardev_id, CHARDEV_MAX_DEVS);
+	xa_destroy(&chardev_devs);
 }
 
 module_init(chardev_init);
@@ -0,0 +1,150 @@
+#ifndef _UAPI_CHARDEV_H
+#define _UAPI_CHARDEV_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define CHARDEV_IOC_MAGIC 0xC7
+
+/*
+ * Header of the shared ring in shmring mode, placed at offset 0 of the
+ * mapping. The data area starts at data_offset and is data_size bytes, a
+ * power of two. head and tail are free-running byte counters owned by the
+ * producer and the consumer respectively; the byte at index i lives at
+ * data_offset + (i & (data_size - 1)).
+ */
+struct chardev_ring_header {
+	__u32 head;
+	__u32 __pad0[15];
+	__u32 tail;
+	__u32 __pad1[15];
+	__u32 flags;
+	__u32 __pad2[15];
+	__u32 data_offset;
+	__u32 data_size;
+};
+
+/* Set in flags while a consumer or producer is asleep in the kernel. */
+#define CHARDEV_RING_READABLE (1U << 0)
+#define CHARDEV_RING_WRITABLE (1U << 1)
+
+/*
+ * In the per-CPU modes, read() returns whole records, each a struct
+ * chardev_record followed by len bytes of payload and padded to
+ * CHARDEV_RECORD_SIZE(len) bytes. timestamp is CLOCK_MONOTONIC in ns.
+ */
+struct chardev_record {
+	__u32 len;
+	__u32 cpu;
+	__u64 timestamp;
+};
+
+#define CHARDEV_RECORD_ALIGN 8
+#define CHARDEV_RECORD_SIZE(len) \
+	((sizeof(struct chardev_record) + (len) + CHARDEV_RECORD_ALIGN - 1) & \
+	 ~(CHARDEV_RECORD_ALIGN - 1))
+
+/*
+ * Batched buffer-mode I/O: entries points to an array of count descriptors
+ * that are executed in order under one acquisition of the device lock.
+ * result receives the number of bytes transferred or a negative errno.
+ * The lengths may add up to at most what a single write() transfers,
+ * otherwise the ioctl fails with E2BIG.
+ */
+struct chardev_batch_entry {
+	__u64 offset;
+	__u64 addr;
+	__u32 len;
+	__u32 op;
+	__s64 result;
+};
+
+#define CHARDEV_BATCH_READ 0
+#define CHARDEV_BATCH_WRITE 1
+
+#define CHARDEV_BATCH_MAX 1024
+
+struct chardev_batch {
+	__u64 entries;
+	__u32 count;
+	__u32 flags;
+};
+
+/*
+ * Atomic operation on the naturally aligned 4 or 8 byte word at offset of
+ * the buffer. For 4 byte words only the low 32 bits of value and expected
+ * are used. result receives the previous value of the word; a compare and
+ * exchange succeeded if it equals expected.
+ */
+struct chardev_atomic {
+	__u64 offset;
+	__u64 value;
+	__u64 expected;
+	__u64 result;
+	__u32 op;
+	__u32 size;
+};
+
+#define CHARDEV_ATOMIC_CMPXCHG 0
+#define CHARDEV_ATOMIC_XCHG 1
+#define CHARDEV_ATOMIC_ADD 2
+#define CHARDEV_ATOMIC_AND 3
+#define CHARDEV_ATOMIC_OR 4
+#define CHARDEV_ATOMIC_XOR 5
+
+/*
+ * Sleep until the naturally aligned 4 or 8 byte word at offset no longer
+ * equals expected. Writes and atomic operations that touch the word wake
+ * the waiter; stores through a mapping do not. A negative timeout_ns
+ * waits forever, otherwise -ETIMEDOUT is returned when it expires.
+ */
+struct chardev_wait {
+	__u64 offset;
+	__u64 expected;
+	__s64 timeout_ns;
+	__u32 size;
+	__u32 flags;
+};
+
+/*
+ * Every change to the buffer is stamped with a generation number at page
+ * granularity. CHARDEV_IOC_CHANGES fills ranges, an array of count entries,
+ * with the byte ranges changed after generation since, sets count to the
+ * number of entries used and gen to the generation to pass as since next
+ * time. If the array is too small, the last range covers all remaining
+ * changes. Stores through a mapping are reported when it is unmapped, and
+ * resizing or switching modes reports the whole buffer.
+ */
+struct chardev_range {
+	__u64 offset;
+	__u64 len;
+};
+
+#define CHARDEV_CHANGES_MAX 1024
+
+struct chardev_changes {
+	__u64 since;
+	__u64 gen;
+	__u64 ranges;
+	__u32 count;
+	__u32 flags;
+};
+
+/* Argument is a mask of CHARDEV_RING_READABLE/WRITABLE. */
+#define CHARDEV_IOC_RING_WAIT _IO(CHARDEV_IOC_MAGIC, 0x01)
+#define CHARDEV_IOC_RING_WAKE _IO(CHARDEV_IOC_MAGIC, 0x02)
+
+#define CHARDEV_IOC_BATCH _IOW(CHARDEV_IOC_MAGIC, 0x03, struct chardev_batch)
+
+/*
+ * Apply a batch of CHARDEV_BATCH_WRITE entries atomically: concurrent
+ * readers observe either none or all of the writes. Every range must lie
+ * within the buffer.
+ */
+#define CHARDEV_IOC_COMMIT _IOW(CHARDEV_IOC_MAGIC, 0x04, struct chardev_batch)
+
+#define CHARDEV_IOC_ATOMIC _IOWR(CHARDEV_IOC_MAGIC, 0x05, struct chardev_atomic)
+#define CHARDEV_IOC_WAIT _IOW(CHARDEV_IOC_MAGIC, 0x06, struct chardev_wait)
+#define CHARDEV_IOC_CHANGES _IOWR(CHARDEV_IOC_MAGIC, 0x07, struct chardev_changes)
+
+#endif